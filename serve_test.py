@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+Exercises ./tinyfont --serve as a client would, comparing every response with what --write outputs for
+the same request, over stdin and over a Unix socket with several workers and concurrent connections.
+Also checks bad requests, stopping the server with SIGTERM and restarting over a stale socket.
+
+Usage: python3 serve_test.py [path-to-tinyfont]
+"""
+import io
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+binary = sys.argv[1] if len(sys.argv) > 1 else './tinyfont'
+failures = []
+
+
+def check(ok, what):
+    if not ok:
+        failures.append(what)
+        print('FAIL: ' + what)
+
+
+def request(w, h, s, fmt, out, text):
+    return ('%d %d %d %s %s %d\n' % (w, h, s, fmt, out, len(text))).encode() + text
+
+
+def response(f):
+    status, length = f.readline().split()
+    return status.decode(), f.read(int(length))
+
+
+def expected(w, h, s, fmt, out, text):
+    args = ['--write', '--width', str(w), '--height', str(h), '--scale', str(s), '--format', fmt, '--output', out]
+    return subprocess.run([binary] + args, input=text, capture_output=True, check=True).stdout
+
+
+def wait_for(predicate):
+    for _ in range(200):
+        if predicate():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+jobs = []
+for text in [b'Hello, World!\nabc', b'Hello, World!\nabd', b'Hello', b'', b'x' * 500, b'Hello, World!\nabc']:
+    for w, h, s in [(80, 25, 1), (40, 30, 2)]:
+        for fmt in ['rgb888', 'rgb565']:
+            for out in ['ascii', 'ppm', 'raw']:
+                jobs.append((w, h, s, fmt, out, text))
+bad_requests = [
+    ((0, 1, 1, 'rgb888', 'ascii', b''), b'Width, height and scale must be positive'),
+    ((5, 5, 1, 'bad', 'ascii', b'zz'), b'Unknown format'),
+    ((20, 8, 2000000000, 'rgb888', 'ascii', b'hi'), b'Scale too large for the framebuffer'),
+    ((20, 8, 4294967297, 'rgb888', 'ascii', b'hi'), b'Scale too large for the framebuffer'),
+]
+
+# Over stdin, one request after another, with bad requests not ending the session
+stream = b''.join(request(*job) for job in jobs)
+stream += b''.join(request(*job) for job, _ in bad_requests)
+stream += request(5, 5, 1, 'rgb888', 'ascii', b'ok')
+result = subprocess.run([binary, '--serve'], input=stream, capture_output=True)
+f = io.BytesIO(result.stdout)
+for job in jobs:
+    status, data = response(f)
+    check(status == 'OK' and data == expected(*job), 'stdin %r' % (job[:5],))
+for job, message in bad_requests:
+    status, data = response(f)
+    check(status == 'ERROR' and data == message, 'stdin error for %r, got %s %r' % (job[:3], status, data))
+status, data = response(f)
+check(status == 'OK' and data == expected(5, 5, 1, 'rgb888', 'ascii', b'ok'), 'stdin request after errors')
+
+# Over a socket, with more connections at once than workers
+path = os.path.join(tempfile.mkdtemp(), 'tinyfont.sock')
+server = subprocess.Popen([binary, '--serve', '--socket', path, '--workers', '3'])
+check(wait_for(lambda: os.path.exists(path)), 'socket created')
+
+
+def client(k):
+    c = socket.socket(socket.AF_UNIX)
+    c.connect(path)
+    f = c.makefile('rwb')
+    for job in jobs[k::3]:
+        f.write(request(*job))
+        f.flush()
+        status, data = response(f)
+        check(status == 'OK' and data == expected(*job), 'socket %r' % (job[:5],))
+    f.write(request(*bad_requests[2][0]))
+    f.flush()
+    check(response(f) == ('ERROR', bad_requests[2][1]), 'socket error response')
+    c.close()
+
+
+threads = [threading.Thread(target=client, args=(k % 3,)) for k in range(6)]
+for t in threads:
+    t.start()
+for t in threads:
+    t.join()
+
+# A second server can't take over a socket which is still answering
+second = subprocess.run([binary, '--serve', '--socket', path], capture_output=True, timeout=10)
+check(second.returncode != 0, 'second server on a live socket refused')
+
+# SIGTERM stops the server, even with an idle connection open, and removes the socket
+idle = socket.socket(socket.AF_UNIX)
+idle.connect(path)
+server.send_signal(signal.SIGTERM)
+check(server.wait(timeout=10) == 0, 'server exits cleanly on SIGTERM')
+check(not os.path.exists(path), 'socket removed on exit')
+idle.close()
+
+# A socket left behind by a killed server is replaced on restart
+server = subprocess.Popen([binary, '--serve', '--socket', path])
+check(wait_for(lambda: os.path.exists(path)), 'socket created again')
+server.kill()
+server.wait()
+check(os.path.exists(path), 'killed server leaves its socket')
+server = subprocess.Popen([binary, '--serve', '--socket', path])
+time.sleep(0.2)
+c = socket.socket(socket.AF_UNIX)
+check(wait_for(lambda: c.connect_ex(path) == 0), 'restart over a stale socket')
+f = c.makefile('rwb')
+f.write(request(5, 5, 1, 'rgb888', 'ascii', b'ok'))
+f.flush()
+check(response(f) == ('OK', expected(5, 5, 1, 'rgb888', 'ascii', b'ok')), 'request after restart')
+c.close()
+server.send_signal(signal.SIGINT)
+check(server.wait(timeout=10) == 0, 'server exits cleanly on SIGINT')
+os.rmdir(os.path.dirname(path))
+
+print('%d failures' % len(failures))
+sys.exit(1 if failures else 0)
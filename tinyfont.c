@@ -2,67 +2,586 @@
  * (C) Copyright Shao Miller, 2022-11-05
  * All rights reserved by the author.
  *
- * Compile with: gcc -ansi -pedantic -Wall -Wextra -Werror -o tinyfont tinyfont.c
+ * Compile with: gcc -ansi -pedantic -Wall -Wextra -Werror -pthread -o tinyfont tinyfont.c
  */
+#define _POSIX_C_SOURCE 200112L
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #define countof(arr) (sizeof (arr) / sizeof *(arr))
 
 enum
   {
+    bench_default_reps = 5,
+    bench_pixel_budget = 1 << 26,
+    bench_text_len = 65536,
+    bits_per_word = CHAR_BIT * sizeof (unsigned long int),
     byte_all_zeroes = 0,
     byte_value_cnt = 1 << CHAR_BIT,
     byte_all_ones = byte_value_cnt - 1,
     bytes_per_font_character = 2,
-    bits_per_pixel = 24,
-    font_height = 5,
-    font_width = 3,
-    max_font_file_line_len = 11,
-    max_font_file_lines = 571,
-    max_write_line = 4096,
+    default_font_height = 5,
+    default_font_width = 3,
+    default_pixel_off = ' ',
+    default_pixel_on = '#',
+    font_file_count_offset = 6,
+    font_file_checksum_offset = 8,
+    font_file_header_len = 12,
+    font_file_height_offset = 5,
+    font_file_width_offset = 4,
+    font_no_glyph = 0xFFFF,
+    font_page_cnt = (0x10FFFF >> CHAR_BIT) + 1,
+    invalid_codepoint = 0x10FFFF + 1,
+    max_font_file_line_len = 33,
+    max_bytes_per_pixel = 4,
+    max_codepoint = 0x10FFFF,
+    max_font_glyphs = 0xFFFF,
+    max_glyph_height = 32,
+    max_glyph_width = 32,
+    max_labels = 32,
+    max_threads = 256,
+    max_input_span = 65536,
+    max_pnm_header_len = 64,
+    max_selftest_scale = 32,
+    max_serve_framebuffers = 4,
+    max_serve_header_len = 128,
+    max_serve_name_len = 31,
+    max_serve_pixels = 1 << 27,
+    max_serve_text_len = 1 << 28,
+    max_serve_workers = 64,
+    min_parallel_glyphs = 256,
+    output_flush_size = 1 << 20,
+    pipeline_slots = 3,
+    pixel_fill_chunk = 4096,
+    pixel_fill_min_doubling = 8,
+    selftest_offsets = 8,
+    utf8_first_multibyte = 0x80,
+    glyph_cache_min_slots = 64,
     enum_zero = 0
   };
 
+/* Phases timed by --stats, in the order they are reported */
+enum
+  {
+    phase_clear,
+    phase_input,
+    phase_render,
+    phase_display,
+    phase_cnt
+  };
+
+/* Layout of one pixel in memory, with a fill routine specialized for its size */
+struct pixel_format
+  {
+    unsigned int bytes_per_pixel;
+    void (* fill)(unsigned char * dest, const unsigned char * pixel, unsigned long int count);
+    int msb_first;
+    const char * name;
+    void (* to_rgb)(const unsigned char * pixel, unsigned char * rgb);
+  };
+
+/*
+ * Bit-packed glyphs of any size up to 32x32, stored row after row with no padding, either the
+ * compiled-in 3x5 default or a memory-mapped font file. A font file is a header of a magic, glyph
+ * width and height bytes, a 16-bit glyph count and a 32-bit FNV-1a checksum of the rest of the file,
+ * both little-endian. With the magic "TFNT", the glyphs for characters 0 to count - 1 follow. With
+ * "TFNU", a 32-bit little-endian codepoint for each glyph follows, then the glyphs in the same order.
+ * Codepoints map to glyphs through a table for the first 256 and pages of 256 for the rest, only
+ * allocated where the font has glyphs
+ */
+struct font
+  {
+    unsigned int bytes_per_glyph;
+    const unsigned char * codepoints;
+    unsigned int count;
+    const unsigned char * glyphs;
+    unsigned int height;
+    unsigned short low[byte_value_cnt];
+    void * map;
+    unsigned long int map_len;
+    unsigned short ** pages;
+    unsigned int width;
+  };
+
+/* A partly decoded UTF-8 sequence, carried from one piece of input to the next */
+struct utf8_decoder
+  {
+    unsigned long int codepoint;
+    unsigned long int min;
+    unsigned int pending;
+  };
+
+/*
+ * Pre-rendered glyph rows for one font, font-scale, pixel format and pair of colours. Glyphs take slots
+ * in the order they are first drawn, so large fonts only cost memory for the glyphs in use
+ */
+struct glyph_cache
+  {
+    unsigned char * buf;
+    const struct font * font;
+    unsigned int font_scale;
+    const struct pixel_format * format;
+    unsigned char pixel_off[max_bytes_per_pixel];
+    unsigned char pixel_on[max_bytes_per_pixel];
+    unsigned long int row_size;
+    unsigned int slot_capacity;
+    unsigned int slot_count;
+    unsigned int * slots;
+  };
+
+/* A rectangle of framebuffer pixels */
+struct rect
+  {
+    unsigned long int height;
+    unsigned long int width;
+    unsigned long int x;
+    unsigned long int y;
+  };
+
+/* Where one glyph goes in the framebuffer */
+struct glyph_placement
+  {
+    unsigned int glyph;
+    unsigned long int x;
+    unsigned long int y;
+  };
+
+/* Glyph placements for some text, reusable while the text, starting cursor, decoder and geometry stay the same */
+struct text_layout
+  {
+    unsigned long int capacity;
+    unsigned long int count;
+    struct utf8_decoder end_decoder;
+    unsigned long int end_origin;
+    unsigned long int end_x;
+    unsigned long int end_y;
+    unsigned int font_scale;
+    unsigned long int height;
+    unsigned long int hwraps;
+    int last;
+    unsigned long int newlines;
+    struct glyph_placement * placements;
+    struct utf8_decoder start_decoder;
+    unsigned long int start_origin;
+    unsigned long int start_x;
+    unsigned long int start_y;
+    char * text;
+    unsigned long int text_capacity;
+    unsigned long int text_len;
+    unsigned long int vwraps;
+    unsigned long int width;
+    int wrapped;
+  };
+
+/* One line of measured text: where it starts in the text, how many glyphs it has and how wide they are */
+struct text_line
+  {
+    unsigned long int glyphs;
+    unsigned long int start;
+    unsigned long int width;
+  };
+
+/*
+ * The size of some text laid out as framebuffer_write() would, wrapping at a width but never vertically,
+ * and the lines it makes. Text can be measured a span at a time
+ */
+struct text_metrics
+  {
+    unsigned long int capacity;
+    unsigned long int char_height;
+    unsigned long int char_start;
+    unsigned long int char_width;
+    unsigned long int cols;
+    struct utf8_decoder decoder;
+    unsigned long int height;
+    unsigned long int line_count;
+    struct text_line * lines;
+    unsigned long int offset;
+    int utf8;
+    unsigned long int width;
+  };
+
+/* Counters and phase timers for --stats, collected only while a framebuffer points at them */
+struct render_stats
+  {
+    unsigned long int glyphs;
+    unsigned long int hwraps;
+    unsigned long int newlines;
+    double phase_time[phase_cnt];
+    unsigned long int pixels;
+    unsigned long int vwraps;
+  };
+
+struct framebuffer;
+
+/* A rendering thread, responsible for one horizontal band of the framebuffer */
+struct raster_worker
+  {
+    struct framebuffer * fb;
+    unsigned int index;
+    pthread_t thread;
+  };
+
+/* Threads that raster a layout together, each into its own band */
+struct raster_pool
+  {
+    pthread_cond_t done;
+    unsigned long int generation;
+    const struct text_layout * layout;
+    pthread_mutex_t lock;
+    unsigned int pending;
+    int quit;
+    pthread_cond_t start;
+    unsigned int thread_count;
+    struct raster_worker * workers;
+  };
+
+/*
+ * The pixels are either in the pixel format, row after row, or with --mono, one bit each in bits, with
+ * each row starting on a new word and the lowest bit leftmost. Mono rows are only expanded into the
+ * pixel format, in line, while they are being encoded for output. With --stream, only buf_lines lines
+ * from buf_y onwards are held at a time. Layouts place glyphs on lines counted from the first line ever
+ * shown; origin is the line at the top of the framebuffer, which only moves with --scroll, and each
+ * line is held in buffer line (line - buf_y) % buf_lines, so scrolling never moves any pixels. With
+ * --target, buf is inside a shared mapping of the output file, after its header
+ */
 struct framebuffer
   {
+    unsigned long int * bits;
     unsigned char * buf;
+    unsigned long int buf_lines;
+    unsigned long int buf_y;
     unsigned int bytes_per_pixel;
+    struct glyph_cache cache;
     unsigned long int cur_x;
     unsigned long int cur_y;
+    struct rect * damage;
+    unsigned long int damage_capacity;
+    unsigned long int damage_count;
+    struct utf8_decoder decoder;
+    unsigned int fallback;
+    const struct font * font;
     unsigned int font_scale;
+    const struct pixel_format * format;
     unsigned long int height;
+    struct text_layout layout;
+    unsigned char * line;
+    void * map;
+    unsigned long int map_len;
+    unsigned long int origin;
+    unsigned char pixel_off[max_bytes_per_pixel];
+    unsigned char pixel_on[max_bytes_per_pixel];
+    struct raster_pool * pool;
+    int scroll;
+    struct text_layout spare_layout;
+    struct render_stats * stats;
+    int utf8;
+    unsigned long int width;
+    unsigned long int words_per_line;
+  };
+
+/* Input text, memory-mapped when it is a regular file and read in large blocks otherwise */
+struct input
+  {
+    char * block;
+    int fd;
+    const char * map;
+    unsigned long int map_len;
+    off_t map_offset;
+    unsigned long int map_pos;
+  };
+
+/* Text drawn by --label at a fixed position, over whatever the framebuffer holds */
+struct label
+  {
+    const char * text;
+    long int x;
+    long int y;
+  };
+
+/* A growable run of text */
+struct text_buffer
+  {
+    char * buf;
+    unsigned long int capacity;
+    unsigned long int len;
+  };
+
+/* Appends a framebuffer to an output stream: a header, then each pixel-line, then a footer */
+struct output_encoder
+  {
+    void (* begin)(struct text_buffer * out, const struct framebuffer * fb);
+    void (* end)(struct text_buffer * out, const struct framebuffer * fb);
+    const char * name;
+    void (* row)(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
+  };
+
+/* A --frames frame on its way through the --pipeline stages, drawn into a framebuffer of its own */
+struct pipeline_slot
+  {
+    struct framebuffer fb;
+    struct text_buffer text;
+  };
+
+/*
+ * The --pipeline stages, which pass frames round a ring of slots: the reading thread fills a slot with
+ * the text of a frame, the render thread draws it, then the output thread encodes it, freeing the slot.
+ * Each count is how many frames a stage has finished, so the frames between two counts are queued for
+ * the later stage, and a frame can be read and another drawn while an older one is being encoded
+ */
+struct pipeline
+  {
+    pthread_cond_t changed;
+    unsigned long int displayed;
+    pthread_mutex_t lock;
+    const struct write_options * options;
+    unsigned long int read;
+    int reading;
+    unsigned long int rendered;
+    struct pipeline_slot slots[pipeline_slots];
+  };
+
+/*
+ * A --serve thread, with the framebuffers it keeps between requests. The lock guards the connection being
+ * served and whether the server is stopping; wake_fd becomes readable when it is
+ */
+struct serve_worker
+  {
+    unsigned long int clock;
+    int conn_fd;
+    unsigned long int fb_last_used[max_serve_framebuffers];
+    struct framebuffer fbs[max_serve_framebuffers];
+    const struct font * font;
+    int listen_fd;
+    pthread_mutex_t lock;
+    int stopping;
+    pthread_t thread;
+    int wake_fd;
+  };
+
+/* Options for --write */
+struct write_options
+  {
+    unsigned long int bg;
+    const struct rect * clip;
+    unsigned long int fallback;
+    unsigned long int fg;
+    const struct font * font;
+    const struct pixel_format * format;
+    int frames;
+    unsigned long int height;
+    unsigned long int label_count;
+    const struct label * labels;
+    int mono;
+    const struct output_encoder * output;
+    int pipeline;
+    unsigned long int scale;
+    int scroll;
+    const char * stats;
+    unsigned long int stream;
+    const char * target;
+    unsigned long int threads;
+    int utf8;
     unsigned long int width;
   };
 
 /* 'C', 'M', 'N', 'm', 'n' contributed by Greg Olszewski */
 static const unsigned char default_font[] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0, 0, 146, 32, 45, 0, 85, 85, 223, 125, 165, 82, 170, 106, 18, 0, 94, 102, 51, 61, 213, 85, 210, 37, 0, 40, 192, 1, 0, 8, 160, 2, 106, 43, 147, 116, 231, 115, 231, 121, 237, 73, 207, 121, 207, 123, 167, 18, 239, 123, 239, 121, 16, 4, 16, 20, 84, 68, 56, 14, 17, 21, 167, 32, 239, 115, 234, 91, 235, 58, 78, 98, 107, 59, 207, 115, 207, 19, 79, 123, 237, 91, 151, 116, 39, 123, 93, 86, 73, 114, 253, 47, 253, 95, 111, 123, 239, 19, 111, 79, 239, 90, 143, 120, 151, 36, 109, 123, 109, 43, 207, 114, 173, 90, 173, 36, 167, 114, 79, 114, 136, 8, 39, 121, 42, 0, 0, 112, 17, 0, 152, 43, 201, 123, 120, 114, 228, 123, 80, 103, 106, 22, 234, 57, 201, 91, 130, 36, 130, 52, 233, 90, 73, 50, 200, 127, 200, 91, 192, 123, 120, 31, 120, 79, 80, 19, 240, 56, 186, 36, 64, 123, 64, 43, 192, 85, 64, 85, 64, 21, 56, 117, 212, 68, 146, 36, 145, 21, 17, 69, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255 };
-static const unsigned char pixel_off[] = "   ";
-static const unsigned char pixel_on[] = "###";
 
+static const char font_file_magic[] = "TFNT";
+static const char font_file_unicode_magic[] = "TFNU";
+
+static void bench(const struct write_options * options, unsigned long int reps);
+static void bench_report(const struct write_options * options, const char * text_name, const char * phase, unsigned long int reps, unsigned long int glyphs, unsigned long int pixels, double best, double total);
+static void bench_text(struct text_buffer * text, const char * text_name, unsigned long int chars_per_line, unsigned long int len);
+static void bits_replace(unsigned long int * line, unsigned long int begin, unsigned long int end, const unsigned long int * src, unsigned long int src_offset);
+static void display_damage(struct text_buffer * out, const struct framebuffer * fb, unsigned long int frame);
+static void encode_ascii_begin(struct text_buffer * out, const struct framebuffer * fb);
+static void encode_ascii_end(struct text_buffer * out, const struct framebuffer * fb);
+static void encode_ascii_pixels(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels, unsigned long int count);
+static void encode_ascii_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
+static void encode_pbm_begin(struct text_buffer * out, const struct framebuffer * fb);
+static void encode_pbm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
+static void encode_pgm_begin(struct text_buffer * out, const struct framebuffer * fb);
+static void encode_pgm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
+static void encode_pnm_header(struct text_buffer * out, const struct framebuffer * fb, const char * magic);
+static void encode_ppm_begin(struct text_buffer * out, const struct framebuffer * fb);
+static void encode_ppm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
+static void encode_raw_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels);
 static void fgets_status(const char * msg, int line, FILE * file);
-static void framebuffer_write(struct framebuffer * fb, const char * text);
-static void pack_font(FILE * font_file);
+static unsigned long int font_checksum(const unsigned char * data, unsigned long int len);
+static unsigned long int font_codepoint(const struct font * font, unsigned int glyph);
+static void font_free(struct font * font);
+static unsigned int font_glyph(const struct font * font, unsigned long int codepoint);
+static void font_index(struct font * font);
+static void font_load(struct font * font, const char * path);
+static unsigned long int font_row(const struct font * font, const unsigned char * glyph, unsigned int y);
+static void framebuffer_clear(struct framebuffer * fb);
+static void framebuffer_clear_rect(struct framebuffer * fb, const struct rect * rect);
+static unsigned long int framebuffer_damage_changes(struct framebuffer * fb, const struct text_layout * old_layout, const struct text_layout * new_layout);
+static void framebuffer_damage_glyph(struct framebuffer * fb, const struct glyph_placement * placement);
+static void framebuffer_draw_at(struct framebuffer * fb, long int x, long int y, const char * text, unsigned long int len, const struct rect * clip);
+static unsigned long int framebuffer_draw_glyph(struct framebuffer * fb, unsigned int glyph_index, long int x, long int y, const struct rect * clip);
+static void framebuffer_draw_placements(struct framebuffer * fb, const struct glyph_placement * placement, const struct glyph_placement * placement_end, const struct rect * clip);
+static void framebuffer_free(struct framebuffer * fb);
+static unsigned int framebuffer_glyph(const struct framebuffer * fb, unsigned long int codepoint);
+static void framebuffer_init(struct framebuffer * fb, const struct write_options * options);
+static unsigned long int framebuffer_line(const struct framebuffer * fb, unsigned long int y);
+static int framebuffer_map(struct framebuffer * fb, const struct write_options * options);
+static const unsigned char * framebuffer_pixels(const struct framebuffer * fb, unsigned long int x, unsigned long int y, unsigned long int count);
+static void framebuffer_raster(struct framebuffer * fb, const struct text_layout * layout);
+static void framebuffer_scroll(struct framebuffer * fb, unsigned long int origin);
+static void framebuffer_sync(const struct framebuffer * fb);
+static void framebuffer_update(struct framebuffer * fb, const char * text, unsigned long int len);
+static void framebuffer_write(struct framebuffer * fb, const char * text, unsigned long int len, int last);
+static const unsigned char * glyph_cache_get(struct framebuffer * fb, unsigned int glyph_index);
+static void input_close(struct input * in);
+static int input_next(struct input * in, const char ** span, unsigned long int * len);
+static void input_open(struct input * in, FILE * file);
+static void measure(const struct font * font, unsigned long int scale, unsigned long int wrap_width, int utf8, int lines, FILE * file);
+static double monotonic_time(void);
+static const struct output_encoder * output_encoder_find(const char * name);
+static void output_flush(struct text_buffer * out, FILE * file);
+static void output_frame(const struct output_encoder * encoder, const struct framebuffer * fb, struct text_buffer * out, FILE * file);
+static void pack_font(FILE * font_file, int binary, unsigned int glyph_width, unsigned int glyph_height);
+static unsigned long int parse_codepoint(const char * str, const char ** end);
+static int parse_integers(const char * str, long int * values, unsigned int count, const char ** end);
+static int parse_number(int argc, char ** argv, int * i, const char * name, int allow_zero, char ** opt, unsigned long int * opt_val);
+static void pipeline_advance(struct pipeline * pipe, unsigned long int * count);
+static void * pipeline_display_main(void * arg);
+static void * pipeline_render_main(void * arg);
+static int pipeline_wait(struct pipeline * pipe, const unsigned long int * count, unsigned long int frame);
+static void pixel_encode(const struct pixel_format * format, unsigned long int value, unsigned char * pixel);
+static void pixel_fill_16(unsigned char * dest, const unsigned char * pixel, unsigned long int count);
+static void pixel_fill_24(unsigned char * dest, const unsigned char * pixel, unsigned long int count);
+static void pixel_fill_32(unsigned char * dest, const unsigned char * pixel, unsigned long int count);
+static void pixel_fill_8(unsigned char * dest, const unsigned char * pixel, unsigned long int count);
+static void pixel_fill_repeat(unsigned char * dest, const unsigned char * pixel, unsigned int bytes_per_pixel, unsigned long int count);
+static const struct pixel_format * pixel_format_find(const char * name);
+static unsigned long int pixel_default(const struct pixel_format * format, unsigned char byte);
+static unsigned long int pixel_value_max(const struct pixel_format * format);
 static void printable_chars(void);
-static void simulation(unsigned long int width, unsigned long int height, unsigned long int scale, FILE * simulation_file);
-static void unpack_font(void);
+static void rgb_from_indexed8(const unsigned char * pixel, unsigned char * rgb);
+static void rgb_from_rgb565(const unsigned char * pixel, unsigned char * rgb);
+static void rgb_from_rgb888(const unsigned char * pixel, unsigned char * rgb);
+static void rgb_from_xrgb8888(const unsigned char * pixel, unsigned char * rgb);
+static void raster_pool_start(struct framebuffer * fb, unsigned int thread_count);
+static void raster_pool_stop(struct framebuffer * fb);
+static void * raster_worker_main(void * arg);
+static void rect_intersect(const struct rect * a, const struct rect * b, struct rect * intersection);
+static void render_stats_draw(struct render_stats * stats, const struct framebuffer * fb, const struct glyph_placement * placement, const struct glyph_placement * placement_end, const struct rect * clip);
+static void render_stats_init(struct render_stats * stats);
+static void render_stats_layout(struct render_stats * stats, const struct text_layout * layout);
+static void render_stats_rects(struct render_stats * stats, const struct rect * rect, const struct rect * rect_end, unsigned long int glyphs);
+static void render_stats_report(const struct render_stats * stats, const char * report);
+static double render_stats_start(const struct render_stats * stats);
+static void render_stats_stop(struct render_stats * stats, unsigned int phase, double start);
+static unsigned long int selftest(const struct font * font);
+static int serve(const char * socket_path, unsigned long int workers, const struct font * font);
+static void serve_connection(struct serve_worker * worker, FILE * in, FILE * out);
+static struct framebuffer * serve_framebuffer(struct serve_worker * worker, const struct write_options * options);
+static void serve_respond(FILE * out, const char * status, const char * data, unsigned long int len);
+static void serve_worker_free(struct serve_worker * worker);
+static void * serve_worker_main(void * arg);
+static void simulation(const struct write_options * options, FILE * simulation_file);
+static void simulation_frame(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, const char * text, unsigned long int len, unsigned long int frame);
+static void simulation_display(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, unsigned long int frame);
+static void simulation_labels(const struct write_options * options, struct framebuffer * fb);
+static void simulation_pipeline(const struct write_options * options, FILE * simulation_file);
+static void simulation_stream(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, const char * text, unsigned long int len);
+static void text_buffer_append(struct text_buffer * text, const char * src, unsigned long int len);
+static void text_buffer_free(struct text_buffer * text);
+static void text_buffer_init(struct text_buffer * text);
+static char * text_buffer_reserve(struct text_buffer * text, unsigned long int len);
+static void text_layout_build(struct text_layout * layout, const struct framebuffer * fb, const char * text, unsigned long int len, int last);
+static void text_layout_free(struct text_layout * layout);
+static void text_layout_init(struct text_layout * layout);
+static int text_layout_reusable(const struct text_layout * layout, const struct framebuffer * fb, const char * text, unsigned long int len, int last);
+static void text_metrics_add(struct text_metrics * metrics, unsigned long int glyphs, unsigned long int start);
+static void text_metrics_free(struct text_metrics * metrics);
+static void text_metrics_init(struct text_metrics * metrics, const struct font * font, unsigned long int scale, unsigned long int wrap_width, int utf8);
+static void text_metrics_line(struct text_metrics * metrics, unsigned long int start);
+static void text_metrics_measure(struct text_metrics * metrics, const char * text, unsigned long int len);
+static void unpack_font(const struct font * font);
+static unsigned int utf8_decode(struct utf8_decoder * decoder, unsigned char byte, unsigned long int * codepoint);
+static void utf8_decoder_init(struct utf8_decoder * decoder);
+
+static const char * const phase_names[] = { "clear", "input", "render", "display" };
+
+/* The first entry is the default */
+static const struct pixel_format pixel_formats[] =
+  {
+    { 3, pixel_fill_24, 1, "rgb888", rgb_from_rgb888 },
+    { 1, pixel_fill_8, 0, "indexed8", rgb_from_indexed8 },
+    { 2, pixel_fill_16, 0, "rgb565", rgb_from_rgb565 },
+    { 4, pixel_fill_32, 0, "xrgb8888", rgb_from_xrgb8888 }
+  };
+
+/* The first entry is the default */
+static const struct output_encoder output_encoders[] =
+  {
+    { encode_ascii_begin, encode_ascii_end, "ascii", encode_ascii_row },
+    { encode_ppm_begin, NULL, "ppm", encode_ppm_row },
+    { encode_pgm_begin, NULL, "pgm", encode_pgm_row },
+    { encode_pbm_begin, NULL, "pbm", encode_pbm_row },
+    { NULL, NULL, "raw", encode_raw_row }
+  };
 
 int main(int argc, char ** argv)
   {
-    char * ep;
+    struct rect clip;
+    struct font font;
     int i;
-    int last_errno;
+    struct label labels[max_labels];
+    const char * num_end;
+    long int num_values[4];
+    char * opt_bg;
+    char * opt_binary;
+    char * opt_clip;
+    char * opt_fallback;
+    char * opt_fg;
+    char * opt_font;
+    char * opt_format;
+    char * opt_frames;
+    char * opt_glyph_height;
+    unsigned long int opt_glyph_height_val;
+    char * opt_glyph_width;
+    unsigned long int opt_glyph_width_val;
     char * opt_height;
-    unsigned long int opt_height_val;
+    char * opt_lines;
+    char * opt_mono;
+    char * opt_output;
+    char * opt_pipeline;
+    char * opt_reps;
+    unsigned long int opt_reps_val;
     char * opt_scale;
-    unsigned long int opt_scale_val;
+    char * opt_scroll;
+    char * opt_socket;
+    char * opt_stats;
+    char * opt_stream;
+    char * opt_target;
+    char * opt_threads;
+    char * opt_utf8;
     char * opt_width;
-    unsigned long int opt_width_val;
+    char * opt_workers;
+    unsigned long int opt_workers_val;
     int opt_write;
+    struct write_options options;
+    unsigned long int value_max;
 
     (void) framebuffer_write;
     /* Sanity-check */
@@ -75,14 +594,58 @@ int main(int argc, char ** argv)
           }
       }
     /* Check mode */
-    if (argc == 2 && strcmp(argv[1], "--pack-font") == 0)
+    if (argc >= 2 && strcmp(argv[1], "--pack-font") == 0)
       {
-        pack_font(stdin);
+        opt_binary = NULL;
+        opt_glyph_height = NULL;
+        opt_glyph_height_val = default_font_height;
+        opt_glyph_width = NULL;
+        opt_glyph_width_val = default_font_width;
+        for (i = 2; i < argc; ++i)
+          {
+            if (strcmp(argv[i], "--binary") == 0)
+              {
+                if (opt_binary != NULL)
+                  {
+                    fprintf(stderr, "--binary already specified\n");
+                    goto usage;
+                  }
+                opt_binary = argv[i];
+                continue;
+              }
+            if (strcmp(argv[i], "--glyph-width") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "glyph-width", 0, &opt_glyph_width, &opt_glyph_width_val))
+                  goto usage;
+                if (opt_glyph_width_val > max_glyph_width)
+                  {
+                    fprintf(stderr, "--glyph-width <glyph-width> must be at most %d\n", max_glyph_width);
+                    goto usage;
+                  }
+                continue;
+              }
+            if (strcmp(argv[i], "--glyph-height") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "glyph-height", 0, &opt_glyph_height, &opt_glyph_height_val))
+                  goto usage;
+                if (opt_glyph_height_val > max_glyph_height)
+                  {
+                    fprintf(stderr, "--glyph-height <glyph-height> must be at most %d\n", max_glyph_height);
+                    goto usage;
+                  }
+                continue;
+              }
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            goto usage;
+          }
+        pack_font(stdin, opt_binary != NULL, opt_glyph_width_val, opt_glyph_height_val);
         return EXIT_SUCCESS;
       }
-    if (argc == 2 && strcmp(argv[1], "--unpack-font") == 0)
+    if ((argc == 2 && strcmp(argv[1], "--unpack-font") == 0) || (argc == 4 && strcmp(argv[1], "--unpack-font") == 0 && strcmp(argv[2], "--font") == 0))
       {
-        unpack_font();
+        font_load(&font, argc == 4 ? argv[3] : NULL);
+        unpack_font(&font);
+        font_free(&font);
         return EXIT_SUCCESS;
       }
     if (argc == 2 && strcmp(argv[1], "--printable-chars") == 0)
@@ -90,462 +653,4058 @@ int main(int argc, char ** argv)
         printable_chars();
         return EXIT_SUCCESS;
       }
-    if (argc == 8)
+    if (argc == 2 && strcmp(argv[1], "--selftest") == 0)
       {
-        ep = NULL;
-        opt_height = NULL;
-        opt_scale = NULL;
-        opt_width = NULL;
-        opt_write = 0;
-        for (i = 1; i < argc; ++i)
+        font_load(&font, NULL);
+        i = selftest(&font) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        font_free(&font);
+        return i;
+      }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+      {
+        opt_format = NULL;
+        opt_reps = NULL;
+        opt_reps_val = bench_default_reps;
+        opt_threads = NULL;
+        options.format = pixel_formats;
+        options.threads = 1;
+        for (i = 2; i < argc; ++i)
           {
-            if (strcmp(argv[i], "--write") == 0)
+            if (strcmp(argv[i], "--reps") == 0)
               {
-                if (opt_write != 0)
+                if (!parse_number(argc, argv, &i, "reps", 0, &opt_reps, &opt_reps_val))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--threads") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "threads", 0, &opt_threads, &options.threads))
+                  goto usage;
+                if (options.threads > max_threads)
                   {
-                    fprintf(stderr, "--write already specified\n");
+                    fprintf(stderr, "--threads <threads> must be at most %d\n", max_threads);
                     goto usage;
                   }
-                opt_write = 1;
                 continue;
               }
-            if (strcmp(argv[i], "--width") == 0)
+            if (strcmp(argv[i], "--format") == 0)
               {
-                if (opt_width != NULL)
+                if (opt_format != NULL)
                   {
-                    fprintf(stderr, "--width already specified\n");
+                    fprintf(stderr, "--format already specified\n");
                     goto usage;
                   }
                 ++i;
-                if(i >= argc)
+                if (i >= argc)
                   {
-                    fprintf(stderr, "Missing <width>\n");
+                    fprintf(stderr, "Missing <format>\n");
                     goto usage;
                   }
-                opt_width = argv[i];
-                if (opt_width[0] == '\0')
+                opt_format = argv[i];
+                options.format = pixel_format_find(opt_format);
+                if (options.format == NULL)
                   {
-                    fprintf(stderr, "Empty <width>\n");
+                    fprintf(stderr, "Unknown <format> '%s'\n", opt_format);
                     goto usage;
                   }
-                errno = 0;
-                opt_width_val = strtoul(opt_width, &ep, 0);
-                last_errno = errno;
-                if (last_errno != 0)
+                continue;
+              }
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            goto usage;
+          }
+        font_load(&font, NULL);
+        options.clip = NULL;
+        options.fallback = invalid_codepoint;
+        options.font = &font;
+        options.label_count = 0;
+        options.labels = NULL;
+        options.mono = 0;
+        options.pipeline = 0;
+        options.scroll = 0;
+        options.stream = 0;
+        options.target = NULL;
+        options.utf8 = 0;
+        bench(&options, opt_reps_val);
+        font_free(&font);
+        return EXIT_SUCCESS;
+      }
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0)
+      {
+        opt_font = NULL;
+        opt_socket = NULL;
+        opt_workers = NULL;
+        opt_workers_val = 1;
+        for (i = 2; i < argc; ++i)
+          {
+            if (strcmp(argv[i], "--socket") == 0)
+              {
+                if (opt_socket != NULL)
                   {
-                    fprintf(stderr, "Error processing <width> option as number:\n  errno:           %d\n  strerror(errno): %s\n", last_errno, strerror(last_errno));
+                    fprintf(stderr, "--socket already specified\n");
                     goto usage;
                   }
-                if (*ep != '\0' || opt_width_val == 0)
+                ++i;
+                if (i >= argc || argv[i][0] == '\0')
                   {
-                    fprintf(stderr, "--width <width> must indicate a positive, non-zero number\n");
+                    fprintf(stderr, "Missing <path>\n");
                     goto usage;
                   }
+                opt_socket = argv[i];
                 continue;
               }
-            if (strcmp(argv[i], "--height") == 0)
+            if (strcmp(argv[i], "--font") == 0)
               {
-                if (opt_height != NULL)
+                if (opt_font != NULL)
                   {
-                    fprintf(stderr, "--height already specified\n");
+                    fprintf(stderr, "--font already specified\n");
                     goto usage;
                   }
                 ++i;
                 if (i >= argc)
                   {
-                    fprintf(stderr, "Missing <height>\n");
-                    goto usage;
-                  }
-                opt_height = argv[i];
-                if (opt_height[0] == '\0')
-                  {
-                    fprintf(stderr, "Empty <height>\n");
-                    goto usage;
-                  }
-                errno = 0;
-                opt_height_val = strtoul(opt_height, &ep, 0);
-                last_errno = errno;
-                if (last_errno != 0)
-                  {
-                    fprintf(stderr, "Error processing <height> option as number:\n  errno:           %d\n  strerror(errno): %s\n", last_errno, strerror(last_errno));
+                    fprintf(stderr, "Missing <font-file>\n");
                     goto usage;
                   }
-                if (*ep != '\0' || opt_height_val == 0)
+                opt_font = argv[i];
+                continue;
+              }
+            if (strcmp(argv[i], "--workers") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "workers", 0, &opt_workers, &opt_workers_val))
+                  goto usage;
+                if (opt_workers_val > max_serve_workers)
                   {
-                    fprintf(stderr, "--height <height> must indicate a positive, non-zero number\n");
+                    fprintf(stderr, "--workers <workers> must be at most %d\n", max_serve_workers);
                     goto usage;
                   }
                 continue;
               }
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            goto usage;
+          }
+        if (opt_workers != NULL && opt_socket == NULL)
+          {
+            fprintf(stderr, "--workers needs --socket\n");
+            goto usage;
+          }
+        font_load(&font, opt_font);
+        i = serve(opt_socket, opt_workers_val, &font);
+        font_free(&font);
+        return i;
+      }
+    if (argc >= 2 && strcmp(argv[1], "--measure") == 0)
+      {
+        opt_font = NULL;
+        opt_lines = NULL;
+        opt_scale = NULL;
+        opt_utf8 = NULL;
+        opt_width = NULL;
+        for (i = 2; i < argc; ++i)
+          {
+            if (strcmp(argv[i], "--width") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "width", 0, &opt_width, &options.width))
+                  goto usage;
+                continue;
+              }
             if (strcmp(argv[i], "--scale") == 0)
               {
-                if (opt_scale != NULL)
+                if (!parse_number(argc, argv, &i, "scale", 0, &opt_scale, &options.scale))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--font") == 0)
+              {
+                if (opt_font != NULL)
                   {
-                    fprintf(stderr, "--scale already specified\n");
+                    fprintf(stderr, "--font already specified\n");
                     goto usage;
                   }
                 ++i;
                 if (i >= argc)
                   {
-                    fprintf(stderr, "Missing <scale>\n");
-                    goto usage;
-                  }
-                opt_scale = argv[i];
-                if (opt_scale[0] == '\0')
-                  {
-                    fprintf(stderr, "Empty <scale>\n");
+                    fprintf(stderr, "Missing <font-file>\n");
                     goto usage;
                   }
-                errno = 0;
-                opt_scale_val = strtoul(opt_scale, &ep, 0);
-                last_errno = errno;
-                if (last_errno != 0)
+                opt_font = argv[i];
+                continue;
+              }
+            if (strcmp(argv[i], "--utf8") == 0)
+              {
+                if (opt_utf8 != NULL)
                   {
-                    fprintf(stderr, "Error processing <scale> option as number:\n  errno:           %d\n  strerror(errno): %s\n", last_errno, strerror(last_errno));
+                    fprintf(stderr, "--utf8 already specified\n");
                     goto usage;
                   }
-                if (*ep != '\0' || opt_scale_val == 0)
+                opt_utf8 = argv[i];
+                continue;
+              }
+            if (strcmp(argv[i], "--lines") == 0)
+              {
+                if (opt_lines != NULL)
                   {
-                    fprintf(stderr, "--scale <scale> must indicate a positive, non-zero number\n");
+                    fprintf(stderr, "--lines already specified\n");
                     goto usage;
                   }
+                opt_lines = argv[i];
                 continue;
               }
             fprintf(stderr, "Invalid option '%s'\n", argv[i]);
             goto usage;
           }
-        if (opt_write == 0 || opt_width == NULL || opt_height == NULL || opt_scale == NULL)
+        if (opt_width == NULL || opt_scale == NULL)
           goto usage;
-        simulation(opt_width_val, opt_height_val, opt_scale_val, stdin);
+        font_load(&font, opt_font);
+        /*
+         * As with --write, a glyph must fit in the width, which keeps the glyph sizes bounded by it, and its
+         * scaled sizes must fit in the unsigned int the font-scale is kept in
+         */
+        if (options.scale > options.width / font.width || options.scale > (UINT_MAX - 1) / max_bytes_per_pixel / font.width || options.scale > (UINT_MAX - 1) / font.height)
+          {
+            fprintf(stderr, "<scale> is too large for a glyph to fit in <width>\n");
+            font_free(&font);
+            goto usage;
+          }
+        measure(&font, options.scale, options.width, opt_utf8 != NULL, opt_lines != NULL, stdin);
+        font_free(&font);
         return EXIT_SUCCESS;
       }
-    usage:
-    printf("Usage:\n\n  ./tinyfont --pack-font\n    Reads a tinyfont file from stdin and outputs the encoded byte-values\n\n  ./tinyfont --unpack-font\n    Decodes the default font and outputs a tinyfont file\n\n  ./tinyfont --printable-chars\n    Display a list of printable characters\n\n  ./tinyfont --write --width <width> --height <height> --scale <scale>\n    Reads from stdin and writes to a simulated framebuffer having the specified dimensions and font-scale\n");
-    return EXIT_FAILURE;
-  }
-
-static void fgets_status(const char * msg, int line, FILE * file)
-  {
-    int last_errno;
-
-    last_errno = errno;
-    fprintf(stderr, "fgets():         %s\nline:            %d\nfeof():          %d\nferror():        %d\nerrno:           %d\nstrerror(errno): %s\n", msg, line, feof(file), ferror(file), last_errno, strerror(last_errno));
-    errno = last_errno;
-  }
-
-static void framebuffer_write(struct framebuffer * fb, const char * text)
-  {
-    int bit_pos;
-    unsigned long int byte_pos;
-    unsigned int char_height;
-    unsigned int char_width;
-    const unsigned char * cptr;
-    unsigned long int fb_size;
-    const unsigned char * pixel;
-    unsigned int scaled_char_height;
-    unsigned int scaled_char_width;
-    unsigned int sx;
-    unsigned int sy;
-    unsigned int x;
-    unsigned int y;
-
-    scaled_char_height = font_height * fb->font_scale;
-    scaled_char_width = font_width * fb->font_scale;
-    char_height = scaled_char_height + 1;
-    char_width = scaled_char_width + 1;
-    fb_size = fb->width * fb->height * fb->bytes_per_pixel;
-    for (cptr = (const unsigned char *) text; *cptr != 0; ++cptr)
+    if (argc >= 8)
       {
-        /* Check for newline or horizontal wrap */
-        if (*cptr == '\n' || fb->cur_x + char_width > fb->width + 1)
-          {
-            fb->cur_x = 0;
-            fb->cur_y += char_height;
-            if (*cptr == '\n')
-              continue;
-          }
-        /* Check for vertical wrap */
-        if (fb->cur_y + char_height > fb->height + 1)
-          fb->cur_y = 0;
-        bit_pos = 0;
-        for (y = 0; y < scaled_char_height; y += fb->font_scale)
+        opt_bg = NULL;
+        opt_clip = NULL;
+        opt_fallback = NULL;
+        opt_fg = NULL;
+        opt_font = NULL;
+        opt_format = NULL;
+        opt_frames = NULL;
+        opt_height = NULL;
+        opt_mono = NULL;
+        opt_output = NULL;
+        opt_pipeline = NULL;
+        opt_scale = NULL;
+        opt_scroll = NULL;
+        opt_stats = NULL;
+        opt_stream = NULL;
+        opt_target = NULL;
+        opt_threads = NULL;
+        opt_utf8 = NULL;
+        opt_width = NULL;
+        opt_write = 0;
+        options.clip = NULL;
+        options.fallback = invalid_codepoint;
+        options.format = pixel_formats;
+        options.frames = 0;
+        options.label_count = 0;
+        options.labels = labels;
+        options.mono = 0;
+        options.output = output_encoders;
+        options.pipeline = 0;
+        options.scroll = 0;
+        options.stats = NULL;
+        options.stream = 0;
+        options.target = NULL;
+        options.threads = 1;
+        options.utf8 = 0;
+        for (i = 1; i < argc; ++i)
           {
-            for (x = 0; x < scaled_char_width; x += fb->font_scale)
+            if (strcmp(argv[i], "--write") == 0)
               {
-                for (sy = 0; sy < fb->font_scale; ++sy)
+                if (opt_write != 0)
                   {
-                    for (sx = 0; sx < fb->font_scale; ++sx)
-                      {
-                        byte_pos = (fb->width * fb->bytes_per_pixel * (fb->cur_y + y + sy)) + ((fb->cur_x + x + sx) * fb->bytes_per_pixel);
-                        /* Bug-guard */
-                        if (byte_pos + fb->bytes_per_pixel > fb_size)
-                          {
-                            fprintf(stderr, "Out of bounds when writing to framebuffer\n");
-                            return;
-                          }
-                        if (default_font[(*cptr * bytes_per_font_character) + (bit_pos / CHAR_BIT)] & (1 << (bit_pos % CHAR_BIT)))
-                          pixel = pixel_on;
-                          else
-                          pixel = pixel_off;
-                        memcpy(fb->buf + byte_pos, pixel, fb->bytes_per_pixel);
-                      }
+                    fprintf(stderr, "--write already specified\n");
+                    goto usage;
                   }
-                ++bit_pos;
+                opt_write = 1;
+                continue;
               }
-          }
-        fb->cur_x += char_width;
-      }
-  }
-
-static void pack_font(FILE * font_file)
-  {
-    int bit_pos;
-    char buf[max_font_file_line_len + 1];
-    unsigned int character;
-    size_t i;
-    int j;
-    int last_errno;
-    int line;
-    size_t line_len;
-    unsigned char packed_encodings[byte_value_cnt][bytes_per_font_character];
-    int pixel;
-    int pixel_line;
-    char * ret;
-    char * search;
-
-    last_errno = errno;
-    /* Make unprintable characters blocks of set bits */
-    for (i = 0; i < countof(packed_encodings); ++i)
-      {
-        for (j = 0; j < bytes_per_font_character; ++j)
-          packed_encodings[i][j] = byte_all_ones;
-      }
-    /* Read and process font file */
-    for (line = 1; line < max_font_file_lines; ++line)
-      {
-        /* Read a line */
+            if (strcmp(argv[i], "--width") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "width", 0, &opt_width, &options.width))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--height") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "height", 0, &opt_height, &options.height))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--scale") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "scale", 0, &opt_scale, &options.scale))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--format") == 0)
+              {
+                if (opt_format != NULL)
+                  {
+                    fprintf(stderr, "--format already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <format>\n");
+                    goto usage;
+                  }
+                opt_format = argv[i];
+                options.format = pixel_format_find(opt_format);
+                if (options.format == NULL)
+                  {
+                    fprintf(stderr, "Unknown <format> '%s'\n", opt_format);
+                    goto usage;
+                  }
+                continue;
+              }
+            if (strcmp(argv[i], "--output") == 0)
+              {
+                if (opt_output != NULL)
+                  {
+                    fprintf(stderr, "--output already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <output>\n");
+                    goto usage;
+                  }
+                opt_output = argv[i];
+                options.output = output_encoder_find(opt_output);
+                if (options.output == NULL)
+                  {
+                    fprintf(stderr, "Unknown <output> '%s'\n", opt_output);
+                    goto usage;
+                  }
+                continue;
+              }
+            if (strcmp(argv[i], "--fg") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "fg", 1, &opt_fg, &options.fg))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--bg") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "bg", 1, &opt_bg, &options.bg))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--frames") == 0)
+              {
+                if (opt_frames != NULL)
+                  {
+                    fprintf(stderr, "--frames already specified\n");
+                    goto usage;
+                  }
+                opt_frames = argv[i];
+                options.frames = 1;
+                continue;
+              }
+            if (strcmp(argv[i], "--pipeline") == 0)
+              {
+                if (opt_pipeline != NULL)
+                  {
+                    fprintf(stderr, "--pipeline already specified\n");
+                    goto usage;
+                  }
+                opt_pipeline = argv[i];
+                options.pipeline = 1;
+                continue;
+              }
+            if (strcmp(argv[i], "--threads") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "threads", 0, &opt_threads, &options.threads))
+                  goto usage;
+                if (options.threads > max_threads)
+                  {
+                    fprintf(stderr, "--threads <threads> must be at most %d\n", max_threads);
+                    goto usage;
+                  }
+                continue;
+              }
+            if (strcmp(argv[i], "--stream") == 0)
+              {
+                if (!parse_number(argc, argv, &i, "stream", 0, &opt_stream, &options.stream))
+                  goto usage;
+                continue;
+              }
+            if (strcmp(argv[i], "--target") == 0)
+              {
+                if (opt_target != NULL)
+                  {
+                    fprintf(stderr, "--target already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <target>\n");
+                    goto usage;
+                  }
+                opt_target = argv[i];
+                options.target = opt_target;
+                continue;
+              }
+            if (strcmp(argv[i], "--scroll") == 0)
+              {
+                if (opt_scroll != NULL)
+                  {
+                    fprintf(stderr, "--scroll already specified\n");
+                    goto usage;
+                  }
+                opt_scroll = argv[i];
+                options.scroll = 1;
+                continue;
+              }
+            if (strcmp(argv[i], "--mono") == 0)
+              {
+                if (opt_mono != NULL)
+                  {
+                    fprintf(stderr, "--mono already specified\n");
+                    goto usage;
+                  }
+                opt_mono = argv[i];
+                options.mono = 1;
+                continue;
+              }
+            if (strcmp(argv[i], "--font") == 0)
+              {
+                if (opt_font != NULL)
+                  {
+                    fprintf(stderr, "--font already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <font-file>\n");
+                    goto usage;
+                  }
+                opt_font = argv[i];
+                continue;
+              }
+            if (strcmp(argv[i], "--utf8") == 0)
+              {
+                if (opt_utf8 != NULL)
+                  {
+                    fprintf(stderr, "--utf8 already specified\n");
+                    goto usage;
+                  }
+                opt_utf8 = argv[i];
+                options.utf8 = 1;
+                continue;
+              }
+            if (strcmp(argv[i], "--fallback") == 0)
+              {
+                if (opt_fallback != NULL)
+                  {
+                    fprintf(stderr, "--fallback already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <fallback>\n");
+                    goto usage;
+                  }
+                opt_fallback = argv[i];
+                /* A single byte stands for itself */
+                if (opt_fallback[0] != '\0' && opt_fallback[1] == '\0')
+                  options.fallback = (unsigned char) opt_fallback[0];
+                  else
+                  {
+                    options.fallback = parse_codepoint(opt_fallback, &num_end);
+                    if (*num_end != '\0')
+                      options.fallback = invalid_codepoint;
+                  }
+                if (options.fallback == invalid_codepoint)
+                  {
+                    fprintf(stderr, "Invalid <fallback> '%s'\n", opt_fallback);
+                    goto usage;
+                  }
+                continue;
+              }
+            if (strcmp(argv[i], "--label") == 0)
+              {
+                if (options.label_count == max_labels)
+                  {
+                    fprintf(stderr, "At most %d --label options\n", max_labels);
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <label>\n");
+                    goto usage;
+                  }
+                if (!parse_integers(argv[i], num_values, 2, &num_end) || *num_end != ',')
+                  {
+                    fprintf(stderr, "Invalid <label> '%s'\n", argv[i]);
+                    goto usage;
+                  }
+                /* Far enough out to be off any framebuffer, with room to add glyph sizes without overflowing */
+                if (num_values[0] < -(LONG_MAX / 4) || num_values[0] > LONG_MAX / 4 || num_values[1] < -(LONG_MAX / 4) || num_values[1] > LONG_MAX / 4)
+                  {
+                    fprintf(stderr, "<label> position must be from %ld to %ld\n", -(LONG_MAX / 4), LONG_MAX / 4);
+                    goto usage;
+                  }
+                labels[options.label_count].text = num_end + 1;
+                labels[options.label_count].x = num_values[0];
+                labels[options.label_count].y = num_values[1];
+                ++options.label_count;
+                continue;
+              }
+            if (strcmp(argv[i], "--clip") == 0)
+              {
+                if (opt_clip != NULL)
+                  {
+                    fprintf(stderr, "--clip already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <clip>\n");
+                    goto usage;
+                  }
+                opt_clip = argv[i];
+                if (!parse_integers(opt_clip, num_values, 4, &num_end) || *num_end != '\0' || num_values[0] < 0 || num_values[1] < 0 || num_values[2] < 0 || num_values[3] < 0)
+                  {
+                    fprintf(stderr, "Invalid <clip> '%s'\n", opt_clip);
+                    goto usage;
+                  }
+                clip.x = num_values[0];
+                clip.y = num_values[1];
+                clip.width = num_values[2];
+                clip.height = num_values[3];
+                options.clip = &clip;
+                continue;
+              }
+            if (strcmp(argv[i], "--stats") == 0)
+              {
+                if (opt_stats != NULL)
+                  {
+                    fprintf(stderr, "--stats already specified\n");
+                    goto usage;
+                  }
+                ++i;
+                if (i >= argc)
+                  {
+                    fprintf(stderr, "Missing <report>\n");
+                    goto usage;
+                  }
+                opt_stats = argv[i];
+                if (strcmp(opt_stats, "text") != 0 && strcmp(opt_stats, "json") != 0)
+                  {
+                    fprintf(stderr, "Unknown <report> '%s'\n", opt_stats);
+                    goto usage;
+                  }
+                options.stats = opt_stats;
+                continue;
+              }
+            fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+            goto usage;
+          }
+        if (opt_write == 0 || opt_width == NULL || opt_height == NULL || opt_scale == NULL)
+          goto usage;
+        if (opt_stream != NULL && (opt_frames != NULL || opt_threads != NULL))
+          {
+            fprintf(stderr, "--stream can't be combined with --frames or --threads\n");
+            goto usage;
+          }
+        if (opt_scroll != NULL && (opt_frames != NULL || opt_stream != NULL))
+          {
+            fprintf(stderr, "--scroll can't be combined with --frames or --stream\n");
+            goto usage;
+          }
+        if (opt_target != NULL && (opt_mono != NULL || opt_scroll != NULL || opt_stream != NULL))
+          {
+            fprintf(stderr, "--target can't be combined with --mono, --scroll or --stream\n");
+            goto usage;
+          }
+        /* Each frame in the pipeline has a framebuffer of its own, but there is only one target to map */
+        if (opt_pipeline != NULL && (opt_frames == NULL || opt_target != NULL))
+          {
+            fprintf(stderr, "--pipeline needs --frames, and can't be combined with --target\n");
+            goto usage;
+          }
+        /* The target holds the pixels as they are, so only outputs which add no more than a header will do */
+        if (opt_target != NULL && strcmp(options.output->name, "raw") != 0 && (strcmp(options.output->name, "ppm") != 0 || options.format->to_rgb != rgb_from_rgb888))
+          {
+            fprintf(stderr, "--target needs <output> raw, or ppm with <format> rgb888\n");
+            goto usage;
+          }
+        /* Colours default to the ASCII-art pixels, in every byte of the pixel */
+        value_max = pixel_value_max(options.format);
+        if (opt_fg == NULL)
+          options.fg = pixel_default(options.format, default_pixel_on);
+        if (opt_bg == NULL)
+          options.bg = pixel_default(options.format, default_pixel_off);
+        if (options.fg > value_max || options.bg > value_max)
+          {
+            fprintf(stderr, "--fg and --bg must fit in a %s pixel\n", options.format->name);
+            goto usage;
+          }
+        font_load(&font, opt_font);
+        options.font = &font;
+        if (options.fallback != invalid_codepoint && font_glyph(&font, options.fallback) == font_no_glyph)
+          {
+            fprintf(stderr, "The font has no glyph for <fallback> '%s'\n", opt_fallback);
+            font_free(&font);
+            goto usage;
+          }
+        /*
+         * A glyph must fit in the framebuffer, so the glyph cache is no larger than the framebuffer either,
+         * and a row of it in bytes must fit in the unsigned int the font-scale and cell sizes are kept in
+         */
+        if (options.scale > options.width / font.width || options.scale > options.height / font.height || options.scale > (UINT_MAX - 1) / max_bytes_per_pixel / font.width || options.scale > (UINT_MAX - 1) / font.height)
+          {
+            fprintf(stderr, "<scale> is too large for a glyph to fit in the framebuffer\n");
+            font_free(&font);
+            goto usage;
+          }
+        if (options.pipeline)
+          simulation_pipeline(&options, stdin);
+          else
+          simulation(&options, stdin);
+        font_free(&font);
+        return EXIT_SUCCESS;
+      }
+    usage:
+    printf("Usage:\n\n  ./tinyfont --pack-font [--binary] [--glyph-width <glyph-width>] [--glyph-height <glyph-height>]\n    Reads a tinyfont file of glyphs of the given size, by default 3x5, from stdin and outputs the encoded byte-values, or with --binary, a font file\n    Lines of U+ and a hexadecimal codepoint can introduce glyphs for any character, in --binary font files only\n\n");
+    printf("  ./tinyfont --unpack-font [--font <font-file>]\n    Decodes the default font, or a font file, and outputs a tinyfont file\n\n  ./tinyfont --printable-chars\n    Display a list of printable characters\n\n");
+    printf("  ./tinyfont --selftest\n    Checks the fast pixel fills and glyph drawing against plain per-pixel copies, for every glyph at font-scales 1 to %d in every format\n\n", max_selftest_scale);
+    printf("  ./tinyfont --write --width <width> --height <height> --scale <scale> [--format <format>] [--fg <pixel>] [--bg <pixel>] [--threads <threads>] [--mono] [--stream <rows>] [--scroll] [--frames] [--pipeline] [--output <output>] [--target <target>] [--stats <report>] [--font <font-file>] [--utf8] [--fallback <fallback>] [--label <label>]... [--clip <clip>]\n    Reads from stdin and writes to a simulated framebuffer having the specified dimensions and font-scale\n");
+    printf("    <format> is one of:");
+    for (i = 0; i < (int) countof(pixel_formats); ++i)
+      printf(" %s", pixel_formats[i].name);
+    printf("\n    <output> is one of:");
+    for (i = 0; i < (int) countof(output_encoders); ++i)
+      printf(" %s", output_encoders[i].name);
+    printf("\n    <pixel> is a foreground or background pixel-value in that format, such as 0xRRGGBB for rgb888\n    <threads> is the number of threads rendering horizontal bands of the framebuffer\n");
+    printf("    --mono keeps one bit per pixel, only converting pixels to <format> as they are output\n    <rows> is the number of text rows drawn and output at a time, holding only that band of the framebuffer\n    --scroll moves the text up a row at a time when it reaches the bottom, rather than going back to the top\n    --frames treats each form-feed as the end of a frame, and displays only the rectangles which changed after the first frame\n");
+    printf("    --pipeline reads, draws and outputs --frames frames in three threads at once, each frame in one of %d framebuffers\n", pipeline_slots);
+    printf("    <target> is a file which is created or resized if need be, then mapped and rendered into directly instead of writing to stdout\n");
+    printf("    <font-file> is a font file written by --pack-font --binary, used instead of the default font\n");
+    printf("    --utf8 decodes the input as UTF-8 rather than taking each byte as a character\n    <fallback> is a character, or U+ and a hexadecimal codepoint, drawn for characters the font has no glyph for, which are otherwise blocks\n");
+    printf("    <label> is '<x>,<y>,<text>', drawn over each frame with its top-left corner at <x>,<y>, which may be negative, and never wrapped\n    <clip> is '<x>,<y>,<width>,<height>', the rectangle outside which labels are cut off, by default the framebuffer\n");
+    printf("    --stats writes phase timings and render counters to stderr when done, where <report> is 'text' or 'json'\n\n");
+    printf("  ./tinyfont --measure --width <width> --scale <scale> [--font <font-file>] [--utf8] [--lines]\n    Measures stdin as --write would lay it out at that width, without drawing it, and outputs '<width> <height> <lines>' in pixels and lines\n    --lines then outputs '<start> <glyphs> <width>' for each line, where <start> is the offset of its first byte\n\n");
+    printf("  ./tinyfont --bench [--reps <reps>] [--format <format>] [--threads <threads>]\n    Times clearing, rendering and ASCII display over a matrix of framebuffer sizes, scales and texts, writing one JSON object per line\n\n");
+    printf("  ./tinyfont --serve [--socket <path>] [--workers <workers>] [--font <font-file>]\n    Renders requests from stdin, or from connections to a Unix socket, keeping framebuffers between requests\n    Each request is a line of '<width> <height> <scale> <format> <output> <length>', then <length> bytes of text\n");
+    printf("    Each response is a line of 'OK <length>' or 'ERROR <length>', then <length> bytes of output or message\n    <workers> is the number of connections served at the same time\n    SIGINT or SIGTERM stops a server on a socket, once the requests in hand are answered, and removes the socket\n");
+    return EXIT_FAILURE;
+  }
+
+/*
+ * Runs every combination of framebuffer size, font-scale and text mix, with one warm-up and then
+ * reps timed repetitions of each phase. Each phase's results are a line of JSON on stdout
+ */
+static void bench(const struct write_options * options, unsigned long int reps)
+  {
+    static const unsigned long int scales[] = { 1, 2, 4, 8, 16, 32 };
+    static const unsigned long int sizes[][2] = { { 80, 25 }, { 640, 480 }, { 1920, 1080 }, { 3840, 2160 }, { 7680, 4320 } };
+    static const char * const text_names[] = { "dense", "newlines", "wrap" };
+    double best;
+    struct write_options case_options;
+    double elapsed;
+    struct framebuffer fb;
+    unsigned long int glyphs;
+    struct text_buffer out;
+    unsigned long int rep;
+    unsigned int scale;
+    unsigned int size;
+    double start;
+    struct text_buffer text;
+    unsigned long int text_len;
+    unsigned int text_name;
+    double total;
+
+    case_options = *options;
+    case_options.bg = pixel_default(options->format, default_pixel_off);
+    case_options.fg = pixel_default(options->format, default_pixel_on);
+    case_options.frames = 0;
+    case_options.output = output_encoders;
+    text_buffer_init(&out);
+    text_buffer_init(&text);
+    for (size = 0; size < countof(sizes); ++size)
+      {
+        case_options.width = sizes[size][0];
+        case_options.height = sizes[size][1];
+        for (scale = 0; scale < countof(scales); ++scale)
+          {
+            /* Skip scales where a single glyph doesn't fit */
+            case_options.scale = scales[scale];
+            if (case_options.font->width * case_options.scale > case_options.width || case_options.font->height * case_options.scale > case_options.height)
+              continue;
+            framebuffer_init(&fb, &case_options);
+            /* Clearing */
+            best = total = 0;
+            for (rep = 0; rep <= reps; ++rep)
+              {
+                start = monotonic_time();
+                framebuffer_clear(&fb);
+                elapsed = monotonic_time() - start;
+                if (rep == 0)
+                  continue;
+                if (rep == 1 || elapsed < best)
+                  best = elapsed;
+                total += elapsed;
+              }
+            bench_report(&case_options, "none", "clear", reps, 0, fb.width * fb.height, best, total);
+            for (text_name = 0; text_name < countof(text_names); ++text_name)
+              {
+                text_len = bench_pixel_budget / (fb.font->width * fb.font->height * fb.font_scale * fb.font_scale);
+                if (text_len > bench_text_len)
+                  text_len = bench_text_len;
+                bench_text(&text, text_names[text_name], (fb.width + 1) / (fb.font->width * fb.font_scale + 1), text_len);
+                /* Layout and raster */
+                best = total = 0;
+                glyphs = 0;
+                for (rep = 0; rep <= reps; ++rep)
+                  {
+                    fb.cur_x = 0;
+                    fb.cur_y = 0;
+                    /* Invalidate the layout while keeping its storage */
+                    fb.layout.font_scale = 0;
+                    start = monotonic_time();
+                    framebuffer_write(&fb, text.buf, text.len, 1);
+                    elapsed = monotonic_time() - start;
+                    glyphs = fb.layout.count;
+                    if (rep == 0)
+                      continue;
+                    if (rep == 1 || elapsed < best)
+                      best = elapsed;
+                    total += elapsed;
+                  }
+                bench_report(&case_options, text_names[text_name], "render", reps, glyphs, glyphs * fb.font->width * fb.font->height * fb.font_scale * fb.font_scale, best, total);
+                /* Raster only, reusing the layout */
+                best = total = 0;
+                for (rep = 0; rep <= reps; ++rep)
+                  {
+                    fb.cur_x = 0;
+                    fb.cur_y = 0;
+                    start = monotonic_time();
+                    framebuffer_write(&fb, text.buf, text.len, 1);
+                    elapsed = monotonic_time() - start;
+                    if (rep == 0)
+                      continue;
+                    if (rep == 1 || elapsed < best)
+                      best = elapsed;
+                    total += elapsed;
+                  }
+                bench_report(&case_options, text_names[text_name], "redraw", reps, glyphs, glyphs * fb.font->width * fb.font->height * fb.font_scale * fb.font_scale, best, total);
+              }
+            /* ASCII display, encoded in memory */
+            best = total = 0;
+            for (rep = 0; rep <= reps; ++rep)
+              {
+                out.len = 0;
+                start = monotonic_time();
+                output_frame(output_encoders, &fb, &out, NULL);
+                elapsed = monotonic_time() - start;
+                if (rep == 0)
+                  continue;
+                if (rep == 1 || elapsed < best)
+                  best = elapsed;
+                total += elapsed;
+              }
+            bench_report(&case_options, "none", "display", reps, 0, fb.width * fb.height, best, total);
+            framebuffer_free(&fb);
+          }
+      }
+    text_buffer_free(&out);
+    text_buffer_free(&text);
+  }
+
+static void bench_report(const struct write_options * options, const char * text_name, const char * phase, unsigned long int reps, unsigned long int glyphs, unsigned long int pixels, double best, double total)
+  {
+    printf("{\"phase\":\"%s\",\"width\":%lu,\"height\":%lu,\"scale\":%lu,\"format\":\"%s\",\"threads\":%lu,\"text\":\"%s\",", phase, options->width, options->height, options->scale, options->format->name, options->threads, text_name);
+    printf("\"reps\":%lu,\"glyphs\":%lu,\"pixels\":%lu,\"best_ns\":%.0f,\"mean_ns\":%.0f,", reps, glyphs, pixels, best * 1e9, total / reps * 1e9);
+    printf("\"glyphs_per_s\":%.0f,\"pixels_per_s\":%.0f,\"ns_per_glyph\":%.3f}\n", best > 0 ? glyphs / best : 0, best > 0 ? pixels / best : 0, glyphs != 0 ? best * 1e9 / glyphs : 0);
+    fflush(stdout);
+  }
+
+/*
+ * Fills text with len characters of one of the benchmark's mixes: "dense" is printable text broken
+ * into lines that fit, "newlines" is lines of 0 to 3 characters in turn, and "wrap" is printable text
+ * with no newlines
+ */
+static void bench_text(struct text_buffer * text, const char * text_name, unsigned long int chars_per_line, unsigned long int len)
+  {
+    char c;
+    unsigned long int i;
+    unsigned long int line_len;
+    unsigned long int line_no;
+
+    text->len = 0;
+    text_buffer_reserve(text, len);
+    line_len = 0;
+    line_no = 0;
+    for (i = 0; i < len; ++i)
+      {
+        c = (char) (' ' + (i % ('~' - ' ' + 1)));
+        if ((strcmp(text_name, "dense") == 0 && line_len == chars_per_line) || (strcmp(text_name, "newlines") == 0 && line_len == line_no % 4))
+          c = '\n';
+        if (c == '\n')
+          {
+            line_len = 0;
+            ++line_no;
+          }
+          else
+          ++line_len;
+        text->buf[text->len++] = c;
+      }
+  }
+
+/*
+ * Replaces bits begin to end - 1 of a mono row with the bits of src starting at bit src_offset, or with
+ * zeroes when src is NULL, a word at a time. src_offset must be at least begin % bits_per_word, and the
+ * word after the last one used must be readable
+ */
+static void bits_replace(unsigned long int * line, unsigned long int begin, unsigned long int end, const unsigned long int * src, unsigned long int src_offset)
+  {
+    unsigned long int first;
+    unsigned long int last;
+    unsigned long int mask;
+    const unsigned long int * sptr;
+    unsigned int shift;
+    unsigned long int value;
+    unsigned long int word;
+
+    first = begin / bits_per_word;
+    last = (end - 1) / bits_per_word;
+    /* Bit 0 of each destination word comes from this bit of src */
+    src_offset -= begin % bits_per_word;
+    sptr = src == NULL ? NULL : src + (src_offset / bits_per_word);
+    shift = src_offset % bits_per_word;
+    for (word = first; word <= last; ++word)
+      {
+        if (src == NULL)
+          value = 0;
+          else
+          value = shift == 0 ? sptr[0] : (sptr[0] >> shift) | (sptr[1] << (bits_per_word - shift));
+        mask = ~0UL;
+        if (word == first)
+          mask &= ~0UL << (begin % bits_per_word);
+        if (word == last && end % bits_per_word != 0)
+          mask &= ~(~0UL << (end % bits_per_word));
+        line[word] = (line[word] & ~mask) | (value & mask);
+        if (sptr != NULL)
+          ++sptr;
+      }
+  }
+
+/* Appends only the rectangles which changed in the last framebuffer_update() */
+static void display_damage(struct text_buffer * out, const struct framebuffer * fb, unsigned long int frame)
+  {
+    char * cptr;
+    const struct rect * rect;
+    const struct rect * rect_end;
+    unsigned long int y;
+
+    cptr = text_buffer_reserve(out, max_pnm_header_len);
+    out->len += sprintf(cptr, "\nframe %lu: %lu dirty rectangle(s)\n", frame, fb->damage_count);
+    rect_end = fb->damage + fb->damage_count;
+    for (rect = fb->damage; rect < rect_end; ++rect)
+      {
+        cptr = text_buffer_reserve(out, max_pnm_header_len);
+        out->len += sprintf(cptr, "@ %lu %lu %lu %lu\n", rect->x, rect->y, rect->width, rect->height);
+        for (y = rect->y; y < rect->y + rect->height; ++y)
+          {
+            text_buffer_append(out, "|", 1);
+            encode_ascii_pixels(out, fb, framebuffer_pixels(fb, rect->x, y, rect->width), rect->width);
+            text_buffer_append(out, "|\n", 2);
+          }
+      }
+  }
+
+static void encode_ascii_begin(struct text_buffer * out, const struct framebuffer * fb)
+  {
+    char * cptr;
+
+    cptr = text_buffer_reserve(out, fb->width + 4);
+    cptr[0] = '\n';
+    cptr[1] = '+';
+    memset(cptr + 2, '-', fb->width);
+    cptr[fb->width + 2] = '+';
+    cptr[fb->width + 3] = '\n';
+    out->len += fb->width + 4;
+  }
+
+static void encode_ascii_end(struct text_buffer * out, const struct framebuffer * fb)
+  {
+    char * cptr;
+
+    cptr = text_buffer_reserve(out, fb->width + 3);
+    cptr[0] = '+';
+    memset(cptr + 1, '-', fb->width);
+    cptr[fb->width + 1] = '+';
+    cptr[fb->width + 2] = '\n';
+    out->len += fb->width + 3;
+  }
+
+/* A pixel is shown as its byte-value if all of its bytes agree, and as 'X' otherwise */
+static void encode_ascii_pixels(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels, unsigned long int count)
+  {
+    unsigned int byte_pos;
+    char * cptr;
+    char * end;
+
+    cptr = text_buffer_reserve(out, count);
+    out->len += count;
+    if (fb->bytes_per_pixel == 1)
+      {
+        memcpy(cptr, pixels, count);
+        return;
+      }
+    for (end = cptr + count; cptr < end; ++cptr, pixels += fb->bytes_per_pixel)
+      {
+        for (byte_pos = 1; byte_pos < fb->bytes_per_pixel; ++byte_pos)
+          {
+            if (pixels[byte_pos] != *pixels)
+              break;
+          }
+        *cptr = byte_pos == fb->bytes_per_pixel ? (char) *pixels : 'X';
+      }
+  }
+
+static void encode_ascii_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels)
+  {
+    text_buffer_append(out, "|", 1);
+    encode_ascii_pixels(out, fb, pixels, fb->width);
+    text_buffer_append(out, "|\n", 2);
+  }
+
+static void encode_pbm_begin(struct text_buffer * out, const struct framebuffer * fb)
+  {
+    encode_pnm_header(out, fb, "P4");
+  }
+
+/* Foreground pixels are black, and anything else is white */
+static void encode_pbm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels)
+  {
+    unsigned char * dest;
+    unsigned long int x;
+
+    dest = (unsigned char *) text_buffer_reserve(out, (fb->width + CHAR_BIT - 1) / CHAR_BIT);
+    out->len += (fb->width + CHAR_BIT - 1) / CHAR_BIT;
+    memset(dest, 0, (fb->width + CHAR_BIT - 1) / CHAR_BIT);
+    for (x = 0; x < fb->width; ++x, pixels += fb->bytes_per_pixel)
+      {
+        if (memcmp(pixels, fb->pixel_on, fb->bytes_per_pixel) == 0)
+          dest[x / CHAR_BIT] |= 1 << (CHAR_BIT - 1 - (x % CHAR_BIT));
+      }
+  }
+
+static void encode_pgm_begin(struct text_buffer * out, const struct framebuffer * fb)
+  {
+    encode_pnm_header(out, fb, "P5");
+  }
+
+/* Indexed pixels are already grey levels; anything else goes through RGB */
+static void encode_pgm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels)
+  {
+    unsigned char * dest;
+    unsigned char * end;
+    unsigned char grey[2];
+    unsigned char rgb[3];
+
+    dest = (unsigned char *) text_buffer_reserve(out, fb->width);
+    out->len += fb->width;
+    if (fb->bytes_per_pixel == 1)
+      {
+        memcpy(dest, pixels, fb->width);
+        return;
+      }
+    fb->format->to_rgb(fb->pixel_off, rgb);
+    grey[0] = (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> CHAR_BIT;
+    fb->format->to_rgb(fb->pixel_on, rgb);
+    grey[1] = (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> CHAR_BIT;
+    for (end = dest + fb->width; dest < end; ++dest, pixels += fb->bytes_per_pixel)
+      {
+        if (memcmp(pixels, fb->pixel_off, fb->bytes_per_pixel) == 0)
+          {
+            *dest = grey[0];
+            continue;
+          }
+        if (memcmp(pixels, fb->pixel_on, fb->bytes_per_pixel) == 0)
+          {
+            *dest = grey[1];
+            continue;
+          }
+        fb->format->to_rgb(pixels, rgb);
+        *dest = (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> CHAR_BIT;
+      }
+  }
+
+static void encode_pnm_header(struct text_buffer * out, const struct framebuffer * fb, const char * magic)
+  {
+    char * cptr;
+
+    cptr = text_buffer_reserve(out, max_pnm_header_len);
+    out->len += sprintf(cptr, "%s\n%lu %lu\n%s", magic, fb->width, fb->height, magic[1] == '4' ? "" : "255\n");
+  }
+
+static void encode_ppm_begin(struct text_buffer * out, const struct framebuffer * fb)
+  {
+    encode_pnm_header(out, fb, "P6");
+  }
+
+/* rgb888 pixels are already in PPM order; anything else is converted */
+static void encode_ppm_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels)
+  {
+    unsigned char * dest;
+    unsigned char * end;
+    unsigned char rgb_off[3];
+    unsigned char rgb_on[3];
+
+    dest = (unsigned char *) text_buffer_reserve(out, fb->width * 3);
+    out->len += fb->width * 3;
+    if (fb->format->to_rgb == rgb_from_rgb888)
+      {
+        memcpy(dest, pixels, fb->width * 3);
+        return;
+      }
+    fb->format->to_rgb(fb->pixel_off, rgb_off);
+    fb->format->to_rgb(fb->pixel_on, rgb_on);
+    for (end = dest + fb->width * 3; dest < end; dest += 3, pixels += fb->bytes_per_pixel)
+      {
+        if (memcmp(pixels, fb->pixel_off, fb->bytes_per_pixel) == 0)
+          memcpy(dest, rgb_off, 3);
+          else if (memcmp(pixels, fb->pixel_on, fb->bytes_per_pixel) == 0)
+          memcpy(dest, rgb_on, 3);
+          else
+          fb->format->to_rgb(pixels, dest);
+      }
+  }
+
+static void encode_raw_row(struct text_buffer * out, const struct framebuffer * fb, const unsigned char * pixels)
+  {
+    text_buffer_append(out, (const char *) pixels, fb->width * fb->bytes_per_pixel);
+  }
+
+static void fgets_status(const char * msg, int line, FILE * file)
+  {
+    int last_errno;
+
+    last_errno = errno;
+    fprintf(stderr, "fgets():         %s\nline:            %d\nfeof():          %d\nferror():        %d\nerrno:           %d\nstrerror(errno): %s\n", msg, line, feof(file), ferror(file), last_errno, strerror(last_errno));
+    errno = last_errno;
+  }
+
+/* 32-bit FNV-1a, which catches truncated and corrupted font files */
+static unsigned long int font_checksum(const unsigned char * data, unsigned long int len)
+  {
+    unsigned long int hash;
+    unsigned long int i;
+
+    hash = 2166136261UL;
+    for (i = 0; i < len; ++i)
+      hash = ((hash ^ data[i]) * 16777619UL) & 0xFFFFFFFFUL;
+    return hash;
+  }
+
+static unsigned long int font_codepoint(const struct font * font, unsigned int glyph)
+  {
+    const unsigned char * cptr;
+
+    if (font->codepoints == NULL)
+      return glyph;
+    cptr = font->codepoints + (glyph * 4UL);
+    return cptr[0] | ((unsigned long int) cptr[1] << 8) | ((unsigned long int) cptr[2] << 16) | ((unsigned long int) cptr[3] << 24);
+  }
+
+static void font_free(struct font * font)
+  {
+    unsigned long int i;
+
+    if (font->pages != NULL)
+      {
+        for (i = 0; i < font_page_cnt; ++i)
+          free(font->pages[i]);
+        free(font->pages);
+      }
+    font->pages = NULL;
+    if (font->map != NULL)
+      munmap(font->map, font->map_len);
+    font->map = NULL;
+  }
+
+/* Returns the glyph for a codepoint, or font_no_glyph */
+static unsigned int font_glyph(const struct font * font, unsigned long int codepoint)
+  {
+    const unsigned short * page;
+
+    if (codepoint < byte_value_cnt)
+      return font->low[codepoint];
+    if (codepoint > max_codepoint || font->pages == NULL)
+      return font_no_glyph;
+    page = font->pages[codepoint >> CHAR_BIT];
+    return page == NULL ? font_no_glyph : page[codepoint & byte_all_ones];
+  }
+
+/* Builds the codepoint to glyph index; when a codepoint repeats, the last glyph wins */
+static void font_index(struct font * font)
+  {
+    unsigned long int codepoint;
+    unsigned int glyph;
+    unsigned long int i;
+    unsigned short * page;
+
+    for (i = 0; i < byte_value_cnt; ++i)
+      font->low[i] = font_no_glyph;
+    font->pages = NULL;
+    for (glyph = 0; glyph < font->count; ++glyph)
+      {
+        codepoint = font_codepoint(font, glyph);
+        if (codepoint < byte_value_cnt)
+          {
+            font->low[codepoint] = glyph;
+            continue;
+          }
+        if (font->pages == NULL)
+          {
+            font->pages = malloc(font_page_cnt * sizeof *font->pages);
+            if (font->pages == NULL)
+              {
+                fprintf(stderr, "Unable to allocate font index\n");
+                exit(EXIT_FAILURE);
+              }
+            for (i = 0; i < font_page_cnt; ++i)
+              font->pages[i] = NULL;
+          }
+        page = font->pages[codepoint >> CHAR_BIT];
+        if (page == NULL)
+          {
+            page = malloc(byte_value_cnt * sizeof *page);
+            if (page == NULL)
+              {
+                fprintf(stderr, "Unable to allocate font index\n");
+                exit(EXIT_FAILURE);
+              }
+            for (i = 0; i < byte_value_cnt; ++i)
+              page[i] = font_no_glyph;
+            font->pages[codepoint >> CHAR_BIT] = page;
+          }
+        page[codepoint & byte_all_ones] = glyph;
+      }
+  }
+
+/*
+ * Maps a font file read-only and validates it once, so that every render can share it. Without a path,
+ * the compiled-in font is used
+ */
+static void font_load(struct font * font, const char * path)
+  {
+    unsigned long int body_len;
+    unsigned int glyph;
+    const unsigned char * header;
+    FILE * font_file;
+    void * map;
+    struct stat st;
+    int unicode;
+
+    font->map = NULL;
+    font->pages = NULL;
+    if (path == NULL)
+      {
+        font->bytes_per_glyph = bytes_per_font_character;
+        font->codepoints = NULL;
+        font->count = byte_value_cnt;
+        font->glyphs = default_font;
+        font->height = default_font_height;
+        font->width = default_font_width;
+        font_index(font);
+        return;
+      }
+    font_file = fopen(path, "rb");
+    if (font_file == NULL)
+      {
+        fprintf(stderr, "Unable to open font file '%s': %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    if (fstat(fileno(font_file), &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        fprintf(stderr, "Font file '%s' is not a regular file\n", path);
+        exit(EXIT_FAILURE);
+      }
+    if (st.st_size < font_file_header_len)
+      {
+        fprintf(stderr, "Font file '%s' is too short\n", path);
+        exit(EXIT_FAILURE);
+      }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(font_file), 0);
+    fclose(font_file);
+    if (map == MAP_FAILED)
+      {
+        fprintf(stderr, "Unable to map font file '%s': %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    header = map;
+    font->map = map;
+    font->map_len = st.st_size;
+    unicode = memcmp(header, font_file_unicode_magic, sizeof font_file_unicode_magic - 1) == 0;
+    if (!unicode && memcmp(header, font_file_magic, sizeof font_file_magic - 1) != 0)
+      {
+        fprintf(stderr, "Font file '%s' is not a tinyfont font file\n", path);
+        exit(EXIT_FAILURE);
+      }
+    font->width = header[font_file_width_offset];
+    font->height = header[font_file_height_offset];
+    font->count = header[font_file_count_offset] | (header[font_file_count_offset + 1] << CHAR_BIT);
+    if (font->width == 0 || font->width > max_glyph_width || font->height == 0 || font->height > max_glyph_height)
+      {
+        fprintf(stderr, "Font file '%s' has %ux%u glyphs, but glyphs must be from 1x1 to %dx%d\n", path, font->width, font->height, max_glyph_width, max_glyph_height);
+        exit(EXIT_FAILURE);
+      }
+    if (font->count == 0 || (!unicode && font->count > byte_value_cnt))
+      {
+        fprintf(stderr, "Font file '%s' must have between 1 and %d glyphs\n", path, unicode ? max_font_glyphs : byte_value_cnt);
+        exit(EXIT_FAILURE);
+      }
+    font->bytes_per_glyph = (font->width * font->height + CHAR_BIT - 1) / CHAR_BIT;
+    body_len = (unsigned long int) font->count * (font->bytes_per_glyph + (unicode ? 4 : 0));
+    if (font->map_len != font_file_header_len + body_len)
+      {
+        fprintf(stderr, "Font file '%s' should be %lu bytes long for %u glyphs\n", path, font_file_header_len + body_len, font->count);
+        exit(EXIT_FAILURE);
+      }
+    if (font_checksum(header + font_file_header_len, body_len) != (header[font_file_checksum_offset] | ((unsigned long int) header[font_file_checksum_offset + 1] << 8) | ((unsigned long int) header[font_file_checksum_offset + 2] << 16) | ((unsigned long int) header[font_file_checksum_offset + 3] << 24)))
+      {
+        fprintf(stderr, "Font file '%s' fails its checksum\n", path);
+        exit(EXIT_FAILURE);
+      }
+    font->codepoints = unicode ? header + font_file_header_len : NULL;
+    font->glyphs = header + font_file_header_len + (unicode ? font->count * 4UL : 0);
+    for (glyph = 0; glyph < font->count; ++glyph)
+      {
+        if (font_codepoint(font, glyph) > max_codepoint)
+          {
+            fprintf(stderr, "Font file '%s' has a codepoint past U+10FFFF for glyph %u\n", path, glyph);
+            exit(EXIT_FAILURE);
+          }
+      }
+    font_index(font);
+  }
+
+/*
+ * Reads row y of a glyph as a mask with bit x set for pixel x. With no glyph, the row is all set bits,
+ * like the unprintable characters of the default font
+ */
+static unsigned long int font_row(const struct font * font, const unsigned char * glyph, unsigned int y)
+  {
+    unsigned long int bit_pos;
+    const unsigned char * byte;
+    unsigned int got;
+    unsigned long int row;
+    unsigned long int row_mask;
+
+    /* Shifting in two steps keeps 32-pixel rows defined */
+    row_mask = ((1UL << (font->width - 1)) << 1) - 1;
+    if (glyph == NULL)
+      return row_mask;
+    /* Rows of whole bytes need no shifting */
+    switch (font->width)
+      {
+        case CHAR_BIT:
+          return glyph[y];
+        case CHAR_BIT * 2:
+          return glyph[y * 2] | ((unsigned long int) glyph[(y * 2) + 1] << CHAR_BIT);
+      }
+    /* Otherwise, gather the bytes which the row spans */
+    bit_pos = (unsigned long int) y * font->width;
+    byte = glyph + (bit_pos / CHAR_BIT);
+    row = *byte >> (bit_pos % CHAR_BIT);
+    for (got = CHAR_BIT - (bit_pos % CHAR_BIT); got < font->width; got += CHAR_BIT)
+      row |= (unsigned long int) *++byte << got;
+    return row & row_mask;
+  }
+
+/* Turns all pixels off */
+static void framebuffer_clear(struct framebuffer * fb)
+  {
+    if (fb->bits != NULL)
+      memset(fb->bits, 0, fb->words_per_line * fb->buf_lines * sizeof *fb->bits);
+      else
+      fb->format->fill(fb->buf, fb->pixel_off, fb->width * fb->buf_lines);
+  }
+
+static void framebuffer_clear_rect(struct framebuffer * fb, const struct rect * rect)
+  {
+    unsigned long int line;
+    unsigned long int y;
+
+    if (rect->width == 0)
+      return;
+    line = framebuffer_line(fb, rect->y);
+    for (y = 0; y < rect->height; ++y)
+      {
+        if (fb->bits != NULL)
+          bits_replace(fb->bits + (fb->words_per_line * line), rect->x, rect->x + rect->width, NULL, 0);
+          else
+          fb->format->fill(fb->buf + (((fb->width * line) + rect->x) * fb->bytes_per_pixel), fb->pixel_off, rect->width);
+        if (++line == fb->buf_lines)
+          line = 0;
+      }
+  }
+
+/*
+ * Adds the cells of the glyphs which differ between two layouts to the damage list, and returns how
+ * many glyphs of the new layout changed. A glyph changed if the character or its position differs at
+ * the same index
+ */
+static unsigned long int framebuffer_damage_changes(struct framebuffer * fb, const struct text_layout * old_layout, const struct text_layout * new_layout)
+  {
+    unsigned long int changed;
+    unsigned long int i;
+    const struct glyph_placement * new_placement;
+    const struct glyph_placement * old_placement;
+
+    changed = 0;
+    for (i = 0; i < old_layout->count || i < new_layout->count; ++i)
+      {
+        old_placement = i < old_layout->count ? old_layout->placements + i : NULL;
+        new_placement = i < new_layout->count ? new_layout->placements + i : NULL;
+        if (old_placement != NULL && new_placement != NULL && old_placement->glyph == new_placement->glyph && old_placement->x == new_placement->x && old_placement->y == new_placement->y)
+          continue;
+        if (old_placement != NULL)
+          framebuffer_damage_glyph(fb, old_placement);
+        if (new_placement != NULL)
+          {
+            framebuffer_damage_glyph(fb, new_placement);
+            ++changed;
+          }
+      }
+    return changed;
+  }
+
+/* Adds a glyph's cell to the damage list, merging it into the previous rectangle on the same text row */
+static void framebuffer_damage_glyph(struct framebuffer * fb, const struct glyph_placement * placement)
+  {
+    struct rect cell;
+    struct rect * last;
+    void * ptr;
+
+    cell.height = fb->font->height * fb->font_scale;
+    cell.width = fb->font->width * fb->font_scale;
+    cell.x = placement->x;
+    cell.y = placement->y;
+    /* Glyphs can hang over the right and bottom edges */
+    if (cell.x + cell.width > fb->width)
+      cell.width = fb->width - cell.x;
+    if (cell.y + cell.height > fb->height)
+      cell.height = fb->height - cell.y;
+    if (fb->damage_count != 0)
+      {
+        last = fb->damage + fb->damage_count - 1;
+        if (last->y == cell.y && last->height == cell.height && cell.x >= last->x && cell.x <= last->x + last->width + 1)
+          {
+            if (cell.x + cell.width > last->x + last->width)
+              last->width = cell.x + cell.width - last->x;
+            return;
+          }
+      }
+    if (fb->damage_count == fb->damage_capacity)
+      {
+        ptr = realloc(fb->damage, (fb->damage_capacity * 2 + 1) * sizeof *fb->damage);
+        if (ptr == NULL)
+          {
+            fprintf(stderr, "Unable to allocate damage list\n");
+            exit(EXIT_FAILURE);
+          }
+        fb->damage = ptr;
+        fb->damage_capacity = fb->damage_capacity * 2 + 1;
+      }
+    fb->damage[fb->damage_count++] = cell;
+  }
+
+/*
+ * Draws text with the top-left corner of its first glyph at x, y from the top-left of the framebuffer,
+ * either of which may be outside it. Lines are never wrapped, and each newline goes back to x on the
+ * next line. Only pixels inside clip, or inside the framebuffer when clip is NULL, are drawn; the
+ * cursor and damage list are left alone, so labels can be composited over whatever the framebuffer
+ * holds
+ */
+static void framebuffer_draw_at(struct framebuffer * fb, long int x, long int y, const char * text, unsigned long int len, const struct rect * clip)
+  {
+    struct rect area;
+    long int char_height;
+    long int char_width;
+    unsigned long int codepoint;
+    unsigned int consumed;
+    const unsigned char * cptr;
+    long int cur_x;
+    long int cur_y;
+    struct utf8_decoder decoder;
+    const unsigned char * end;
+    unsigned long int pixels;
+
+    /* The clip rectangle, limited to the framebuffer */
+    area.height = fb->height;
+    area.width = fb->width;
+    area.x = 0;
+    area.y = 0;
+    if (clip != NULL)
+      {
+        area.x = clip->x < fb->width ? clip->x : fb->width;
+        area.y = clip->y < fb->height ? clip->y : fb->height;
+        area.width = clip->width < fb->width - area.x ? clip->width : fb->width - area.x;
+        area.height = clip->height < fb->height - area.y ? clip->height : fb->height - area.y;
+      }
+    /* Positions are from the top of the framebuffer, wherever it has scrolled to */
+    area.y += fb->origin;
+    y += fb->origin;
+    char_height = fb->font->height * fb->font_scale + 1;
+    char_width = fb->font->width * fb->font_scale + 1;
+    cur_x = x;
+    cur_y = y;
+    utf8_decoder_init(&decoder);
+    end = (const unsigned char *) text + len;
+    for (cptr = (const unsigned char *) text; cptr < end || decoder.pending != 0; cptr += consumed)
+      {
+        consumed = 1;
+        /* A sequence left unfinished at the end is drawn as an invalid character, as in text_layout_build() */
+        if (cptr == end)
+          {
+            consumed = 0;
+            codepoint = invalid_codepoint;
+            utf8_decoder_init(&decoder);
+          }
+          else if (decoder.pending == 0 && (*cptr < utf8_first_multibyte || !fb->utf8))
+          codepoint = *cptr;
+          else
+          {
+            consumed = utf8_decode(&decoder, *cptr, &codepoint);
+            if (decoder.pending != 0)
+              continue;
+          }
+        if (codepoint == '\n')
+          {
+            cur_x = x;
+            cur_y += char_height;
+            /* Lines only move down, so nothing more can be visible */
+            if (cur_y >= (long int) (area.y + area.height))
+              break;
+            continue;
+          }
+        /* Nothing more on this line can be visible, and the cursor stops short of overflowing */
+        if (cur_x >= (long int) (area.x + area.width))
+          continue;
+        pixels = framebuffer_draw_glyph(fb, framebuffer_glyph(fb, codepoint), cur_x, cur_y, &area);
+        if (fb->stats != NULL && pixels != 0)
+          {
+            ++fb->stats->glyphs;
+            fb->stats->pixels += pixels;
+          }
+        cur_x += char_width;
+      }
+  }
+
+/*
+ * Draws the part of a glyph at x, y which is inside clip, which must be inside the framebuffer, and
+ * returns how many pixels that was. The visible part is worked out once, so each pixel-line is one copy
+ */
+static unsigned long int framebuffer_draw_glyph(struct framebuffer * fb, unsigned int glyph_index, long int x, long int y, const struct rect * clip)
+  {
+    const unsigned long int * bits;
+    long int bottom;
+    unsigned long int buf_line;
+    unsigned long int count;
+    unsigned char * dest;
+    long int left;
+    unsigned long int * line;
+    long int right;
+    unsigned long int row_size;
+    unsigned long int row_words;
+    unsigned long int span_size;
+    const unsigned char * src;
+    unsigned long int stride;
+    unsigned int sub_row;
+    long int top;
+
+    left = x < (long int) clip->x ? (long int) clip->x : x;
+    right = x + (long int) (fb->font->width * fb->font_scale);
+    if (right > (long int) (clip->x + clip->width))
+      right = clip->x + clip->width;
+    top = y < (long int) clip->y ? (long int) clip->y : y;
+    bottom = y + (long int) (fb->font->height * fb->font_scale);
+    if (bottom > (long int) (clip->y + clip->height))
+      bottom = clip->y + clip->height;
+    if (left >= right || top >= bottom)
+      return 0;
+    sub_row = (top - y) % fb->font_scale;
+    buf_line = framebuffer_line(fb, top);
+    if (fb->bits != NULL)
+      {
+        /* Cached mono rows start with a word of padding, so glyph column 0 is bit bits_per_word */
+        bits = (const unsigned long int *) glyph_cache_get(fb, glyph_index);
+        row_words = fb->cache.row_size / sizeof *bits;
+        bits += ((top - y) / fb->font_scale) * row_words;
+        line = fb->bits + (fb->words_per_line * buf_line);
+        for (count = bottom - top; count != 0; --count)
+          {
+            bits_replace(line, left, right, bits, (left - x) + bits_per_word);
+            if (++sub_row == fb->font_scale)
+              {
+                sub_row = 0;
+                bits += row_words;
+              }
+            /* A scrolled framebuffer's lines wrap around the end of the buffer */
+            line += fb->words_per_line;
+            if (++buf_line == fb->buf_lines)
+              {
+                buf_line = 0;
+                line = fb->bits;
+              }
+          }
+        return (right - left) * (bottom - top);
+      }
+    row_size = fb->font->width * fb->font_scale * fb->bytes_per_pixel;
+    span_size = (right - left) * fb->bytes_per_pixel;
+    stride = fb->width * fb->bytes_per_pixel;
+    src = glyph_cache_get(fb, glyph_index) + (((top - y) / fb->font_scale) * row_size) + ((left - x) * fb->bytes_per_pixel);
+    dest = fb->buf + (stride * buf_line) + (left * fb->bytes_per_pixel);
+    for (count = bottom - top; count != 0; --count)
+      {
+        memcpy(dest, src, span_size);
+        /* Each font row is font-scale pixel-lines tall */
+        if (++sub_row == fb->font_scale)
+          {
+            sub_row = 0;
+            src += row_size;
+          }
+        dest += stride;
+        if (++buf_line == fb->buf_lines)
+          {
+            buf_line = 0;
+            dest = fb->buf + (left * fb->bytes_per_pixel);
+          }
+      }
+    return (right - left) * (bottom - top);
+  }
+
+static void framebuffer_draw_placements(struct framebuffer * fb, const struct glyph_placement * placement, const struct glyph_placement * placement_end, const struct rect * clip)
+  {
+    for (; placement < placement_end; ++placement)
+      framebuffer_draw_glyph(fb, placement->glyph, placement->x, placement->y, clip);
+  }
+
+static void framebuffer_free(struct framebuffer * fb)
+  {
+    raster_pool_stop(fb);
+    text_layout_free(&fb->layout);
+    text_layout_free(&fb->spare_layout);
+    free(fb->cache.buf);
+    free(fb->cache.slots);
+    free(fb->damage);
+    free(fb->bits);
+    if (fb->map != NULL)
+      munmap(fb->map, fb->map_len);
+      else
+      free(fb->buf);
+    free(fb->line);
+  }
+
+/* The glyph for a codepoint, or the fallback when the font has none */
+static unsigned int framebuffer_glyph(const struct framebuffer * fb, unsigned long int codepoint)
+  {
+    unsigned int glyph;
+
+    glyph = codepoint < byte_value_cnt ? fb->font->low[codepoint] : font_glyph(fb->font, codepoint);
+    return glyph == font_no_glyph ? fb->fallback : glyph;
+  }
+
+static void framebuffer_init(struct framebuffer * fb, const struct write_options * options)
+  {
+    fb->bytes_per_pixel = options->format->bytes_per_pixel;
+    fb->cache.buf = NULL;
+    fb->cache.slots = NULL;
+    fb->cur_x = 0;
+    fb->cur_y = 0;
+    fb->damage = NULL;
+    fb->damage_capacity = 0;
+    fb->damage_count = 0;
+    utf8_decoder_init(&fb->decoder);
+    fb->font = options->font;
+    /* Without a fallback glyph, characters with no glyph are drawn as blocks */
+    fb->fallback = font_glyph(fb->font, options->fallback);
+    if (fb->fallback == font_no_glyph)
+      fb->fallback = fb->font->count;
+    fb->font_scale = options->scale;
+    fb->format = options->format;
+    fb->height = options->height;
+    text_layout_init(&fb->layout);
+    fb->origin = 0;
+    pixel_encode(fb->format, options->bg, fb->pixel_off);
+    pixel_encode(fb->format, options->fg, fb->pixel_on);
+    fb->scroll = options->scroll;
+    text_layout_init(&fb->spare_layout);
+    fb->stats = NULL;
+    fb->utf8 = options->utf8;
+    fb->width = options->width;
+    fb->bits = NULL;
+    fb->buf = NULL;
+    /* A band of whole text rows, or the whole framebuffer */
+    fb->buf_lines = fb->height;
+    if (options->stream != 0 && options->stream < fb->height / (fb->font->height * fb->font_scale + 1))
+      fb->buf_lines = options->stream * (fb->font->height * fb->font_scale + 1);
+    fb->buf_y = 0;
+    fb->line = NULL;
+    fb->map = NULL;
+    fb->words_per_line = (fb->width + bits_per_word - 1) / bits_per_word;
+    if (fb->width > ULONG_MAX / max_bytes_per_pixel / fb->buf_lines)
+      {
+        fprintf(stderr, "Framebuffer of %lu by %lu pixels is too large\n", fb->width, fb->buf_lines);
+        exit(EXIT_FAILURE);
+      }
+    /* A target keeps the pixels it already had when it is the right size */
+    if (options->target != NULL)
+      {
+        if (framebuffer_map(fb, options))
+          framebuffer_clear(fb);
+        raster_pool_start(fb, options->threads);
+        return;
+      }
+    /* A mono framebuffer only needs one line in the pixel format, to encode from */
+    if (options->mono)
+      {
+        fb->bits = malloc(fb->words_per_line * fb->buf_lines * sizeof *fb->bits);
+        fb->line = malloc(fb->width * fb->bytes_per_pixel);
+      }
+      else
+      fb->buf = malloc(fb->width * fb->buf_lines * fb->bytes_per_pixel);
+    if (options->mono ? fb->bits == NULL || fb->line == NULL : fb->buf == NULL)
+      {
+        fprintf(stderr, "Simulation unable to allocate memory\n");
+        exit(EXIT_FAILURE);
+      }
+    raster_pool_start(fb, options->threads);
+    framebuffer_clear(fb);
+  }
+
+/*
+ * Creates or opens the --target file, sizes it for the output header and the pixels, writes the header
+ * and maps it shared, so the pixels are drawn straight into the file. Returns whether the file was
+ * created or resized, when its pixels need clearing
+ */
+static int framebuffer_map(struct framebuffer * fb, const struct write_options * options)
+  {
+    int fd;
+    struct text_buffer header;
+    void * map;
+    int resized;
+    struct stat st;
+
+    text_buffer_init(&header);
+    if (options->output->begin != NULL)
+      options->output->begin(&header, fb);
+    fb->map_len = header.len + (fb->width * fb->height * fb->bytes_per_pixel);
+    fd = open(options->target, O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+      {
+        fprintf(stderr, "Unable to open target '%s': %s\n", options->target, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      {
+        fprintf(stderr, "Target '%s' is not a regular file\n", options->target);
+        exit(EXIT_FAILURE);
+      }
+    resized = (unsigned long int) st.st_size != fb->map_len;
+    if (resized && ftruncate(fd, fb->map_len) != 0)
+      {
+        fprintf(stderr, "Unable to size target '%s': %s\n", options->target, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    map = mmap(NULL, fb->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      {
+        fprintf(stderr, "Unable to map target '%s': %s\n", options->target, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+    fb->map = map;
+    if (header.len != 0)
+      memcpy(fb->map, header.buf, header.len);
+    fb->buf = (unsigned char *) fb->map + header.len;
+    text_buffer_free(&header);
+    return resized;
+  }
+
+/* The buffer line holding a layout line */
+static unsigned long int framebuffer_line(const struct framebuffer * fb, unsigned long int y)
+  {
+    return (y - fb->buf_y) % fb->buf_lines;
+  }
+
+/*
+ * Returns count pixels of line y from the top of the framebuffer, starting at column x, in the pixel
+ * format. Mono pixels are expanded into the framebuffer's line buffer, a run of equal pixels at a time,
+ * skipping over whole words
+ */
+static const unsigned char * framebuffer_pixels(const struct framebuffer * fb, unsigned long int x, unsigned long int y, unsigned long int count)
+  {
+    unsigned long int bit;
+    unsigned char * dest;
+    unsigned long int end;
+    const unsigned long int * line;
+    unsigned long int run;
+
+    y = framebuffer_line(fb, fb->origin + y);
+    if (fb->bits == NULL)
+      return fb->buf + (((fb->width * y) + x) * fb->bytes_per_pixel);
+    line = fb->bits + (fb->words_per_line * y);
+    dest = fb->line;
+    for (end = x + count; x < end; x += run)
+      {
+        bit = (line[x / bits_per_word] >> (x % bits_per_word)) & 1;
+        for (run = 1; x + run < end; )
+          {
+            if ((x + run) % bits_per_word == 0 && x + run + bits_per_word <= end && line[(x + run) / bits_per_word] == (bit ? ~0UL : 0))
+              run += bits_per_word;
+              else if (((line[(x + run) / bits_per_word] >> ((x + run) % bits_per_word)) & 1) == bit)
+              ++run;
+              else
+              break;
+          }
+        fb->format->fill(dest, bit ? fb->pixel_on : fb->pixel_off, run);
+        dest += run * fb->bytes_per_pixel;
+      }
+    return fb->line;
+  }
+
+static void framebuffer_raster(struct framebuffer * fb, const struct text_layout * layout)
+  {
+    struct rect band;
+    const struct glyph_placement * placement;
+    const struct glyph_placement * placement_end;
+    struct raster_pool * pool;
+
+    band.width = fb->width;
+    band.x = 0;
+    band.y = fb->origin;
+    placement_end = layout->placements + layout->count;
+    /* Small layouts are not worth waking the other threads for */
+    pool = fb->pool;
+    if (pool == NULL || layout->count < min_parallel_glyphs)
+      {
+        band.height = fb->height;
+        framebuffer_draw_placements(fb, layout->placements, placement_end, &band);
+      }
+      else
+      {
+        /* Workers only read the glyph cache, so fill it beforehand */
+        for (placement = layout->placements; placement < placement_end; ++placement)
+          glyph_cache_get(fb, placement->glyph);
+        /* Every thread draws the whole layout, in order, clipped to its own band */
+        pthread_mutex_lock(&pool->lock);
+        pool->layout = layout;
+        pool->pending = pool->thread_count;
+        ++pool->generation;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+        band.height = fb->height / (pool->thread_count + 1);
+        framebuffer_draw_placements(fb, layout->placements, placement_end, &band);
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending != 0)
+          pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+      }
+    if (fb->stats != NULL)
+      {
+        band.height = fb->height;
+        render_stats_draw(fb->stats, fb, layout->placements, placement_end, &band);
+      }
+  }
+
+/*
+ * Moves the top of the framebuffer down to line origin. Only the lines scrolled into view at the bottom
+ * are cleared, so scrolling costs as much as the lines it uncovers, whatever the framebuffer's height
+ */
+static void framebuffer_scroll(struct framebuffer * fb, unsigned long int origin)
+  {
+    struct rect uncovered;
+
+    uncovered.height = origin - fb->origin < fb->height ? origin - fb->origin : fb->height;
+    uncovered.width = fb->width;
+    uncovered.x = 0;
+    uncovered.y = origin + fb->height - uncovered.height;
+    framebuffer_clear_rect(fb, &uncovered);
+    fb->origin = origin;
+  }
+
+/* Flushes a --target mapping to its file, so readers of the file see the whole render */
+static void framebuffer_sync(const struct framebuffer * fb)
+  {
+    if (msync(fb->map, fb->map_len, MS_SYNC) != 0)
+      {
+        fprintf(stderr, "Unable to sync target: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+  }
+
+/*
+ * Replaces the text drawn by the previous framebuffer_update() with new text, drawn from the top-left.
+ * Only the cells of glyphs which differ from the previous layout are redrawn, and they are left in the
+ * framebuffer's damage list for the output stage. When many changed, the render threads redraw it all
+ */
+static void framebuffer_update(struct framebuffer * fb, const char * text, unsigned long int len)
+  {
+    unsigned long int changed;
+    struct rect full;
+    unsigned long int i;
+    struct text_layout * new_layout;
+    const struct glyph_placement * new_placement;
+    struct text_layout * old_layout;
+    const struct glyph_placement * old_placement;
+    const struct rect * rect;
+    const struct rect * rect_end;
+    struct text_layout swap;
+
+    fb->damage_count = 0;
+    fb->cur_x = 0;
+    fb->cur_y = 0;
+    utf8_decoder_init(&fb->decoder);
+    if (text_layout_reusable(&fb->layout, fb, text, len, 1))
+      return;
+    old_layout = &fb->layout;
+    new_layout = &fb->spare_layout;
+    text_layout_build(new_layout, fb, text, len, 1);
+    changed = framebuffer_damage_changes(fb, old_layout, new_layout);
+    rect_end = fb->damage + fb->damage_count;
+    for (rect = fb->damage; rect < rect_end; ++rect)
+      framebuffer_clear_rect(fb, rect);
+    if (fb->pool != NULL && changed >= min_parallel_glyphs && changed * (fb->pool->thread_count + 1) >= new_layout->count)
+      {
+        /*
+         * Redrawing the whole layout in bands on every thread is quicker than redrawing this many changed
+         * glyphs on one. Unchanged glyphs are drawn again as they were, and in order, so nothing else moves
+         */
+        framebuffer_raster(fb, new_layout);
+      }
+      else if (!old_layout->wrapped && !new_layout->wrapped)
+      {
+        /* No glyphs overlap, so only the changed glyphs need drawing */
+        full.height = fb->height;
+        full.width = fb->width;
+        full.x = 0;
+        full.y = 0;
+        for (i = 0; i < new_layout->count; ++i)
+          {
+            new_placement = new_layout->placements + i;
+            old_placement = i < old_layout->count ? old_layout->placements + i : NULL;
+            if (old_placement == NULL || old_placement->glyph != new_placement->glyph || old_placement->x != new_placement->x || old_placement->y != new_placement->y)
+              {
+                framebuffer_draw_placements(fb, new_placement, new_placement + 1, &full);
+                if (fb->stats != NULL)
+                  render_stats_draw(fb->stats, fb, new_placement, new_placement + 1, &full);
+              }
+          }
+      }
+      else
+      {
+        /* A vertical wrap can overlap glyphs, so redraw everything inside each rectangle, in order */
+        for (rect = fb->damage; rect < rect_end; ++rect)
+          framebuffer_draw_placements(fb, new_layout->placements, new_layout->placements + new_layout->count, rect);
+        if (fb->stats != NULL)
+          render_stats_rects(fb->stats, fb->damage, rect_end, changed);
+      }
+    if (fb->stats != NULL)
+      render_stats_layout(fb->stats, new_layout);
+    fb->cur_x = new_layout->end_x;
+    fb->cur_y = new_layout->end_y;
+    swap = *old_layout;
+    *old_layout = *new_layout;
+    *new_layout = swap;
+  }
+
+static void framebuffer_write(struct framebuffer * fb, const char * text, unsigned long int len, int last)
+  {
+    /* Redrawing the same text from the same place skips the layout pass */
+    if (!text_layout_reusable(&fb->layout, fb, text, len, last))
+      text_layout_build(&fb->layout, fb, text, len, last);
+    if (fb->layout.end_origin != fb->origin)
+      framebuffer_scroll(fb, fb->layout.end_origin);
+    framebuffer_raster(fb, &fb->layout);
+    if (fb->stats != NULL)
+      render_stats_layout(fb->stats, &fb->layout);
+    fb->decoder = fb->layout.end_decoder;
+    fb->cur_x = fb->layout.end_x;
+    fb->cur_y = fb->layout.end_y;
+  }
+
+/* Glyphs are numbered as in the font, and glyph_index font->count is the block drawn when there is no glyph */
+static const unsigned char * glyph_cache_get(struct framebuffer * fb, unsigned int glyph_index)
+  {
+    unsigned long int bit;
+    unsigned long int * bits;
+    struct glyph_cache * cache;
+    unsigned char * dest;
+    const unsigned char * glyph;
+    unsigned long int glyph_size;
+    unsigned int i;
+    void * ptr;
+    unsigned long int row;
+    unsigned int run;
+    unsigned int x;
+    unsigned int y;
+
+    cache = &fb->cache;
+    /* The cached rows are only good for one font, font-scale, pixel format and pair of colours */
+    if (cache->slots == NULL || cache->font != fb->font || cache->font_scale != fb->font_scale || cache->format != fb->format || memcmp(cache->pixel_on, fb->pixel_on, fb->bytes_per_pixel) != 0 || memcmp(cache->pixel_off, fb->pixel_off, fb->bytes_per_pixel) != 0)
+      {
+        free(cache->buf);
+        free(cache->slots);
+        cache->buf = NULL;
+        cache->font = fb->font;
+        cache->font_scale = fb->font_scale;
+        cache->format = fb->format;
+        memcpy(cache->pixel_off, fb->pixel_off, fb->bytes_per_pixel);
+        memcpy(cache->pixel_on, fb->pixel_on, fb->bytes_per_pixel);
+        cache->row_size = (unsigned long int) fb->font->width * fb->font_scale * fb->bytes_per_pixel;
+        /* Mono rows are words with one of padding either side, for shifting into place */
+        if (fb->bits != NULL)
+          cache->row_size = ((((unsigned long int) fb->font->width * fb->font_scale + bits_per_word - 1) / bits_per_word) + 2) * sizeof (unsigned long int);
+        cache->slot_capacity = 0;
+        cache->slot_count = 0;
+        cache->slots = malloc((fb->font->count + 1UL) * sizeof *cache->slots);
+        if (cache->slots == NULL)
+          {
+            fprintf(stderr, "Unable to allocate glyph cache\n");
+            exit(EXIT_FAILURE);
+          }
+        for (i = 0; i <= fb->font->count; ++i)
+          cache->slots[i] = 0;
+      }
+    glyph_size = cache->row_size * fb->font->height;
+    if (cache->slots[glyph_index] != 0)
+      return cache->buf + (glyph_size * (cache->slots[glyph_index] - 1));
+    if (cache->slot_count == cache->slot_capacity)
+      {
+        i = cache->slot_capacity == 0 ? glyph_cache_min_slots : cache->slot_capacity * 2;
+        ptr = realloc(cache->buf, glyph_size * i);
+        if (ptr == NULL)
+          {
+            fprintf(stderr, "Unable to allocate glyph cache\n");
+            exit(EXIT_FAILURE);
+          }
+        cache->buf = ptr;
+        cache->slot_capacity = i;
+      }
+    dest = cache->buf + (glyph_size * cache->slot_count);
+    glyph = glyph_index < fb->font->count ? fb->font->glyphs + (glyph_index * fb->font->bytes_per_glyph) : NULL;
+    if (fb->bits != NULL)
+      {
+        /* Each font-pixel becomes font-scale bits, after the word of padding */
+        bits = (unsigned long int *) dest;
+        memset(bits, 0, glyph_size);
+        for (y = 0; y < fb->font->height; ++y, bits += cache->row_size / sizeof *bits)
+          {
+            row = font_row(fb->font, glyph, y);
+            for (x = 0; x < fb->font->width; ++x)
+              {
+                if (((row >> x) & 1) == 0)
+                  continue;
+                for (bit = bits_per_word + (x * cache->font_scale); bit < bits_per_word + ((x + 1UL) * cache->font_scale); ++bit)
+                  bits[bit / bits_per_word] |= 1UL << (bit % bits_per_word);
+              }
+          }
+        cache->slots[glyph_index] = ++cache->slot_count;
+        return cache->buf + (glyph_size * (cache->slot_count - 1));
+      }
+    /* Expand each run of equal font-pixels horizontally with a single fill; vertical scaling happens when drawing */
+    for (y = 0; y < fb->font->height; ++y)
+      {
+        row = font_row(fb->font, glyph, y);
+        for (x = 0; x < fb->font->width; x += run)
+          {
+            bit = (row >> x) & 1;
+            for (run = 1; x + run < fb->font->width; ++run)
+              {
+                if (((row >> (x + run)) & 1) != bit)
+                  break;
+              }
+            cache->format->fill(dest, bit ? cache->pixel_on : cache->pixel_off, run * cache->font_scale);
+            dest += run * cache->font_scale * cache->format->bytes_per_pixel;
+          }
+      }
+    cache->slots[glyph_index] = ++cache->slot_count;
+    return cache->buf + (glyph_size * (cache->slot_count - 1));
+  }
+
+static void input_close(struct input * in)
+  {
+    /* Leave the file just past the input used, as reading it would have */
+    if (in->map != NULL)
+      {
+        munmap((void *) in->map, in->map_len);
+        lseek(in->fd, in->map_offset + (off_t) in->map_pos, SEEK_SET);
+      }
+    free(in->block);
+  }
+
+/* Produces the next span of at most max_input_span bytes, or returns 0 at the end of the input */
+static int input_next(struct input * in, const char ** span, unsigned long int * len)
+  {
+    int last_errno;
+    ssize_t ret;
+
+    if (in->map != NULL)
+      {
+        if (in->map_pos == in->map_len)
+          return 0;
+        *span = in->map + in->map_pos;
+        *len = in->map_len - in->map_pos;
+        if (*len > max_input_span)
+          *len = max_input_span;
+        in->map_pos += *len;
+        return 1;
+      }
+    do
+      ret = read(in->fd, in->block, max_input_span);
+    while (ret < 0 && errno == EINTR);
+    if (ret < 0)
+      {
+        last_errno = errno;
+        fprintf(stderr, "read():          -1\nerrno:           %d\nstrerror(errno): %s\n", last_errno, strerror(last_errno));
+        errno = last_errno;
+        return 0;
+      }
+    *span = in->block;
+    *len = ret;
+    return ret != 0;
+  }
+
+static void input_open(struct input * in, FILE * file)
+  {
+    void * map;
+    off_t offset;
+    long int page_size;
+    struct stat st;
+
+    in->block = NULL;
+    in->fd = fileno(file);
+    in->map = NULL;
+    in->map_len = 0;
+    in->map_offset = 0;
+    in->map_pos = 0;
+    /*
+     * Map the rest of a regular file from its current position, so that no input is copied; the mapping
+     * starts on the page boundary before it, and anything the caller has already read is skipped
+     */
+    offset = lseek(in->fd, 0, SEEK_CUR);
+    page_size = sysconf(_SC_PAGESIZE);
+    if (offset >= 0 && page_size > 0 && fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset)
+      {
+        in->map_offset = offset - (offset % page_size);
+        map = mmap(NULL, st.st_size - in->map_offset, PROT_READ, MAP_PRIVATE, in->fd, in->map_offset);
+        if (map != MAP_FAILED)
+          {
+            posix_madvise(map, st.st_size - in->map_offset, POSIX_MADV_SEQUENTIAL);
+            in->map = map;
+            in->map_len = st.st_size - in->map_offset;
+            in->map_pos = offset - in->map_offset;
+            return;
+          }
+      }
+    /* Otherwise, read in large blocks */
+    in->block = malloc(max_input_span);
+    if (in->block == NULL)
+      {
+        fprintf(stderr, "Unable to allocate input buffer\n");
+        exit(EXIT_FAILURE);
+      }
+  }
+
+/* Measures all of the input, then writes the bounding box and line count, and with --lines, each line */
+static void measure(const struct font * font, unsigned long int scale, unsigned long int wrap_width, int utf8, int lines, FILE * file)
+  {
+    struct input in;
+    unsigned long int i;
+    unsigned long int len;
+    struct text_metrics metrics;
+    const char * span;
+
+    text_metrics_init(&metrics, font, scale, wrap_width, utf8);
+    input_open(&in, file);
+    while (input_next(&in, &span, &len))
+      text_metrics_measure(&metrics, span, len);
+    input_close(&in);
+    /* As --write draws it, input which ends part way through a sequence has a glyph for it */
+    if (metrics.decoder.pending != 0)
+      text_metrics_add(&metrics, 1, metrics.char_start);
+    printf("%lu %lu %lu\n", metrics.width, metrics.height, metrics.line_count);
+    for (i = 0; lines && i < metrics.line_count; ++i)
+      printf("%lu %lu %lu\n", metrics.lines[i].start, metrics.lines[i].glyphs, metrics.lines[i].width);
+    text_metrics_free(&metrics);
+  }
+
+/* Seconds since an arbitrary point, for measuring intervals */
+static double monotonic_time(void)
+  {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+  }
+
+static const struct output_encoder * output_encoder_find(const char * name)
+  {
+    unsigned int i;
+
+    for (i = 0; i < countof(output_encoders); ++i)
+      {
+        if (strcmp(name, output_encoders[i].name) == 0)
+          return output_encoders + i;
+      }
+    return NULL;
+  }
+
+static void output_flush(struct text_buffer * out, FILE * file)
+  {
+    if (out->len != 0)
+      fwrite(out->buf, 1, out->len, file);
+    out->len = 0;
+  }
+
+/* Encodes a whole frame, writing it out in large pieces, or keeping all of it in the buffer when there is no file */
+static void output_frame(const struct output_encoder * encoder, const struct framebuffer * fb, struct text_buffer * out, FILE * file)
+  {
+    unsigned long int y;
+
+    if (encoder->begin != NULL)
+      encoder->begin(out, fb);
+    for (y = 0; y < fb->height; ++y)
+      {
+        encoder->row(out, fb, framebuffer_pixels(fb, 0, y, fb->width));
+        if (file != NULL && out->len >= output_flush_size)
+          output_flush(out, file);
+      }
+    if (encoder->end != NULL)
+      encoder->end(out, fb);
+    if (file != NULL)
+      output_flush(out, file);
+  }
+
+/*
+ * Characters are given by a line ending with the character itself, or by a line of "U+" and a hexadecimal
+ * codepoint, optionally followed by a space and anything, of any length. Without "U+" lines, the font
+ * covers the 256 byte-values, with unprintable characters as blocks, otherwise it only has the glyphs given
+ */
+static void pack_font(FILE * font_file, int binary, unsigned int glyph_width, unsigned int glyph_height)
+  {
+    int bit_pos;
+    unsigned char * body;
+    unsigned long int body_len;
+    char buf[max_font_file_line_len + 1];
+    unsigned int bytes_per_glyph;
+    int c;
+    unsigned long int capacity;
+    unsigned long int checksum;
+    unsigned long int codepoint;
+    unsigned long int * codepoints;
+    unsigned long int count;
+    unsigned char * glyphs;
+    unsigned char header[font_file_header_len];
+    size_t i;
+    unsigned int j;
+    int last_errno;
+    int line;
+    size_t line_len;
+    int max_lines;
+    const char * num_end;
+    unsigned char * packed_encodings;
+    unsigned int pixel;
+    unsigned int pixel_line;
+    void * ptr;
+    char * ret;
+    char * search;
+    int unicode;
+
+    last_errno = errno;
+    bytes_per_glyph = (glyph_width * glyph_height + CHAR_BIT - 1) / CHAR_BIT;
+    capacity = 0;
+    codepoints = NULL;
+    count = 0;
+    glyphs = NULL;
+    unicode = 0;
+    /* Read and process font file, which has at most a header line and the pixel-lines for each glyph */
+    max_lines = (glyph_height + 1) * max_font_glyphs + 1;
+    for (line = 1; line < max_lines; ++line)
+      {
+        /* Read a line */
+        errno = 0;
+        ret = fgets(buf, sizeof buf, font_file);
+        if (ret == NULL)
+          {
+            fgets_status("NULL", line, font_file);
+            break;
+          }
+        /* It must end with the character to be represented, then a newline */
+        search = strchr(buf, '\n');
+        if (search == NULL && strncmp(buf, "U+", 2) == 0)
+          {
+            /* A "U+" line can run on past the buffer with its annotation, which is skipped */
+            while ((c = getc(font_file)) != EOF && c != '\n')
+              ;
+          }
+          else if (search == NULL || search == buf)
+          {
+            fprintf(stderr, "Expected printable character, then newline on line %d\n", line);
+            exit(EXIT_FAILURE);
+          }
+        if (strncmp(buf, "U+", 2) == 0)
+          {
+            codepoint = parse_codepoint(buf, &num_end);
+            if (codepoint == invalid_codepoint || (*num_end != '\n' && *num_end != ' '))
+              {
+                fprintf(stderr, "Expected codepoint from U+0000 to U+10FFFF on line %d\n", line);
+                exit(EXIT_FAILURE);
+              }
+            unicode = 1;
+          }
+          else
+          {
+            /* The previous character needs to be printable */
+            if (!isprint(search[-1]))
+              {
+                fprintf(stderr, "Expected printable character before newline on line %d\n", line);
+                exit(EXIT_FAILURE);
+              }
+            /* Now we know the index of the character */
+            codepoint = *(unsigned char *) (search - 1);
+          }
+        if (count == max_font_glyphs)
+          {
+            fprintf(stderr, "More than %d glyphs on line %d\n", max_font_glyphs, line);
+            exit(EXIT_FAILURE);
+          }
+        if (count == capacity)
+          {
+            capacity = capacity == 0 ? byte_value_cnt : capacity * 2;
+            ptr = realloc(codepoints, capacity * sizeof *codepoints);
+            if (ptr == NULL)
+              {
+                fprintf(stderr, "Unable to allocate font\n");
+                exit(EXIT_FAILURE);
+              }
+            codepoints = ptr;
+            ptr = realloc(glyphs, capacity * bytes_per_glyph);
+            if (ptr == NULL)
+              {
+                fprintf(stderr, "Unable to allocate font\n");
+                exit(EXIT_FAILURE);
+              }
+            glyphs = ptr;
+          }
+        codepoints[count] = codepoint;
+        /* Clear all bits for the character */
+        memset(glyphs + (count * bytes_per_glyph), byte_all_zeroes, bytes_per_glyph);
+        /* Read the pixels */
+        bit_pos = 0;
+        for (pixel_line = 0; pixel_line < glyph_height; ++pixel_line)
+          {
+            ++line;
+            errno = 0;
+            ret = fgets(buf, sizeof buf, font_file);
+            if (ret == NULL)
+              {
+                fgets_status("NULL", line, font_file);
+                fprintf(stderr, "Expected line of pixels of '0' or '1' on line %d\n", line);
+                exit(EXIT_FAILURE);
+              }
+            line_len = strlen(ret);
+            if (line_len < glyph_width || (line_len > glyph_width && buf[glyph_width] != '\n'))
+              {
+                fprintf(stderr, "Expected %u pixels of '0' or '1' on line %d\n", glyph_width, line);
+                exit(EXIT_FAILURE);
+              }
+            /* Process each pixel */
+            for (pixel = 0; pixel < glyph_width; ++pixel)
+              {
+                if (buf[pixel] != '0' && buf[pixel] != '1')
+                  {
+                    fprintf(stderr, "Expected '0' or '1' for pixel %u on line %d\n", pixel + 1, line);
+                    exit(EXIT_FAILURE);
+                  }
+                glyphs[(count * bytes_per_glyph) + (bit_pos / CHAR_BIT)] |= (buf[pixel] == '0' ? 0 : 1) << (bit_pos % CHAR_BIT);
+                ++bit_pos;
+              }
+            if (feof(font_file) || ferror(font_file))
+              {
+                fgets_status("OK", line, font_file);
+                break;
+              }
+          }
+        /* Did we get all pixel-lines? */
+        if (pixel_line < glyph_height)
+          {
+            fprintf(stderr, "Expected %u more lines of pixels after line %d\n", (glyph_height - 1) - pixel_line, line);
+            exit(EXIT_FAILURE);
+          }
+        ++count;
+        if (feof(font_file) || ferror(font_file))
+          {
+            fgets_status("OK", line, font_file);
+            break;
+          }
+      }
+    /* All done */
+    if (unicode)
+      {
+        if (!binary)
+          {
+            fprintf(stderr, "Fonts with U+ codepoints can only be packed with --binary\n");
+            exit(EXIT_FAILURE);
+          }
+        /* The codepoints, then the glyphs in the same order */
+        body_len = count * (4 + bytes_per_glyph);
+        body = malloc(body_len);
+        if (body == NULL)
+          {
+            fprintf(stderr, "Unable to allocate font\n");
+            exit(EXIT_FAILURE);
+          }
+        for (i = 0; i < count; ++i)
+          {
+            for (j = 0; j < 4; ++j)
+              body[(i * 4) + j] = (codepoints[i] >> (j * CHAR_BIT)) & byte_all_ones;
+          }
+        memcpy(body + (count * 4), glyphs, count * bytes_per_glyph);
+        memcpy(header, font_file_unicode_magic, sizeof font_file_unicode_magic - 1);
+      }
+      else
+      {
+        /* Make unprintable characters blocks of set bits; when a character repeats, the last glyph wins */
+        body_len = byte_value_cnt * bytes_per_glyph;
+        body = malloc(body_len);
+        if (body == NULL)
+          {
+            fprintf(stderr, "Unable to allocate font\n");
+            exit(EXIT_FAILURE);
+          }
+        memset(body, byte_all_ones, body_len);
+        for (i = 0; i < count; ++i)
+          memcpy(body + (codepoints[i] * bytes_per_glyph), glyphs + (i * bytes_per_glyph), bytes_per_glyph);
+        count = byte_value_cnt;
+        memcpy(header, font_file_magic, sizeof font_file_magic - 1);
+      }
+    free(codepoints);
+    free(glyphs);
+    if (binary)
+      {
+        header[font_file_width_offset] = glyph_width;
+        header[font_file_height_offset] = glyph_height;
+        header[font_file_count_offset] = count & byte_all_ones;
+        header[font_file_count_offset + 1] = count >> CHAR_BIT;
+        checksum = font_checksum(body, body_len);
+        for (j = 0; j < 4; ++j)
+          header[font_file_checksum_offset + j] = (checksum >> (j * CHAR_BIT)) & byte_all_ones;
+        if (fwrite(header, 1, sizeof header, stdout) != sizeof header || fwrite(body, 1, body_len, stdout) != body_len || fflush(stdout) != 0)
+          {
+            fprintf(stderr, "Unable to write font file\n");
+            exit(EXIT_FAILURE);
+          }
+        free(body);
+        errno = last_errno;
+        return;
+      }
+    packed_encodings = body;
+    printf("Font encodes as these bytes: ");
+    i = 0;
+    goto jump_in;
+    for (; i < byte_value_cnt; ++i)
+      {
+        printf(", ");
+        jump_in:
+        j = 0;
+        goto jump_in2;
+        for (; j < bytes_per_glyph; ++j)
+          {
+            printf(", ");
+            jump_in2:
+            printf("%d", packed_encodings[(i * bytes_per_glyph) + j]);
+          }
+      }
+    printf("\n");
+    free(packed_encodings);
+    errno = last_errno;
+  }
+
+/* Parses "U+" and a hexadecimal codepoint, returning invalid_codepoint if there is none */
+static unsigned long int parse_codepoint(const char * str, const char ** end)
+  {
+    unsigned long int codepoint;
+    const char * cptr;
+
+    *end = str;
+    if (strncmp(str, "U+", 2) != 0 || !isxdigit((unsigned char) str[2]))
+      return invalid_codepoint;
+    codepoint = 0;
+    for (cptr = str + 2; isxdigit((unsigned char) *cptr); ++cptr)
+      {
+        codepoint = (codepoint * 16) + (isdigit((unsigned char) *cptr) ? *cptr - '0' : (tolower((unsigned char) *cptr) - 'a') + 10);
+        if (codepoint > max_codepoint)
+          return invalid_codepoint;
+      }
+    *end = cptr;
+    return codepoint;
+  }
+
+/* Parses count comma-separated decimal integers, which may be negative */
+static int parse_integers(const char * str, long int * values, unsigned int count, const char ** end)
+  {
+    char * ep;
+    unsigned int i;
+
+    *end = str;
+    for (i = 0; i < count; ++i)
+      {
+        if (i != 0)
+          {
+            if (*str != ',')
+              return 0;
+            ++str;
+          }
+        if (*str != '-' && !isdigit((unsigned char) *str))
+          return 0;
         errno = 0;
-        ret = fgets(buf, sizeof buf, font_file);
-        if (ret == NULL)
+        values[i] = strtol(str, &ep, 10);
+        if (errno != 0 || ep == str)
+          return 0;
+        str = ep;
+      }
+    *end = str;
+    return 1;
+  }
+
+static int parse_number(int argc, char ** argv, int * i, const char * name, int allow_zero, char ** opt, unsigned long int * opt_val)
+  {
+    char * ep;
+    int last_errno;
+
+    if (*opt != NULL)
+      {
+        fprintf(stderr, "--%s already specified\n", name);
+        return 0;
+      }
+    ++*i;
+    if (*i >= argc)
+      {
+        fprintf(stderr, "Missing <%s>\n", name);
+        return 0;
+      }
+    *opt = argv[*i];
+    if (**opt == '\0')
+      {
+        fprintf(stderr, "Empty <%s>\n", name);
+        return 0;
+      }
+    ep = NULL;
+    errno = 0;
+    *opt_val = strtoul(*opt, &ep, 0);
+    last_errno = errno;
+    if (last_errno != 0)
+      {
+        fprintf(stderr, "Error processing <%s> option as number:\n  errno:           %d\n  strerror(errno): %s\n", name, last_errno, strerror(last_errno));
+        return 0;
+      }
+    if (*ep != '\0' || (*opt_val == 0 && !allow_zero))
+      {
+        fprintf(stderr, "--%s <%s> must indicate a %snumber\n", name, name, allow_zero ? "" : "positive, non-zero ");
+        return 0;
+      }
+    return 1;
+  }
+
+/*
+ * Finishes a frame in one stage, handing it to the next. The reading thread also waits here until the
+ * slot of the frame after is free, which is when the frame that slot last held has been output
+ */
+static void pipeline_advance(struct pipeline * pipe, unsigned long int * count)
+  {
+    pthread_mutex_lock(&pipe->lock);
+    ++*count;
+    pthread_cond_broadcast(&pipe->changed);
+    if (count == &pipe->read)
+      while (pipe->read - pipe->displayed >= pipeline_slots)
+        pthread_cond_wait(&pipe->changed, &pipe->lock);
+    pthread_mutex_unlock(&pipe->lock);
+  }
+
+/* The output stage; after the first frame, ASCII output shows what changed since the frame before */
+static void * pipeline_display_main(void * arg)
+  {
+    unsigned long int frame;
+    struct text_buffer out;
+    struct pipeline * pipe;
+
+    pipe = arg;
+    text_buffer_init(&out);
+    for (frame = 0; pipeline_wait(pipe, &pipe->rendered, frame); ++frame)
+      {
+        simulation_display(pipe->options, &pipe->slots[frame % pipeline_slots].fb, &out, frame + 1);
+        pipeline_advance(pipe, &pipe->displayed);
+      }
+    text_buffer_free(&out);
+    return NULL;
+  }
+
+/*
+ * The render stage. A slot's framebuffer is updated from the frame it held pipeline_slots frames ago,
+ * so its damage list is then made again against the frame before, which is what the output stage shows
+ */
+static void * pipeline_render_main(void * arg)
+  {
+    unsigned long int frame;
+    struct pipeline * pipe;
+    const struct pipeline_slot * previous;
+    struct pipeline_slot * slot;
+    double start;
+
+    pipe = arg;
+    for (frame = 0; pipeline_wait(pipe, &pipe->read, frame); ++frame)
+      {
+        slot = pipe->slots + frame % pipeline_slots;
+        start = render_stats_start(slot->fb.stats);
+        framebuffer_update(&slot->fb, slot->text.buf, slot->text.len);
+        simulation_labels(pipe->options, &slot->fb);
+        if (frame != 0)
+          {
+            previous = pipe->slots + (frame - 1) % pipeline_slots;
+            slot->fb.damage_count = 0;
+            framebuffer_damage_changes(&slot->fb, &previous->fb.layout, &slot->fb.layout);
+          }
+        render_stats_stop(slot->fb.stats, phase_render, start);
+        pipeline_advance(pipe, &pipe->rendered);
+      }
+    return NULL;
+  }
+
+/* Waits until the stage before has finished a frame, returning zero once the input has no more frames for it */
+static int pipeline_wait(struct pipeline * pipe, const unsigned long int * count, unsigned long int frame)
+  {
+    int ready;
+
+    pthread_mutex_lock(&pipe->lock);
+    while (*count <= frame && (pipe->reading || *count < pipe->read))
+      pthread_cond_wait(&pipe->changed, &pipe->lock);
+    ready = *count > frame;
+    pthread_mutex_unlock(&pipe->lock);
+    return ready;
+  }
+
+static void pixel_encode(const struct pixel_format * format, unsigned long int value, unsigned char * pixel)
+  {
+    unsigned int i;
+
+    for (i = 0; i < format->bytes_per_pixel; ++i)
+      pixel[format->msb_first ? format->bytes_per_pixel - 1 - i : i] = (value >> (i * CHAR_BIT)) & byte_all_ones;
+  }
+
+/* Short runs are stored one fixed-size pixel at a time, longer ones are repeated block copies */
+#define define_pixel_fill(bits) \
+  static void pixel_fill_ ## bits(unsigned char * dest, const unsigned char * pixel, unsigned long int count) \
+    { \
+      if (count >= pixel_fill_min_doubling) \
+        { \
+          pixel_fill_repeat(dest, pixel, (bits) / CHAR_BIT, count); \
+          return; \
+        } \
+      for (; count > 0; --count, dest += (bits) / CHAR_BIT) \
+        memcpy(dest, pixel, (bits) / CHAR_BIT); \
+    }
+
+define_pixel_fill(16)
+define_pixel_fill(24)
+define_pixel_fill(32)
+
+static void pixel_fill_8(unsigned char * dest, const unsigned char * pixel, unsigned long int count)
+  {
+    memset(dest, *pixel, count);
+  }
+
+static void pixel_fill_repeat(unsigned char * dest, const unsigned char * pixel, unsigned int bytes_per_pixel, unsigned long int count)
+  {
+    unsigned long int chunk;
+    unsigned long int done;
+    unsigned int i;
+    unsigned long int size;
+
+    /* A pixel made of one repeated byte-value is a plain memset() */
+    for (i = 1; i < bytes_per_pixel; ++i)
+      {
+        if (pixel[i] != pixel[0])
+          break;
+      }
+    size = count * bytes_per_pixel;
+    if (i == bytes_per_pixel)
+      {
+        memset(dest, pixel[0], size);
+        return;
+      }
+    /* Seed one pixel, double the filled prefix up to a cache-friendly chunk, then repeat the chunk */
+    memcpy(dest, pixel, bytes_per_pixel);
+    for (done = bytes_per_pixel; done < size && done < pixel_fill_chunk; done *= 2)
+      memcpy(dest + done, dest, size - done < done ? size - done : done);
+    for (chunk = done; done < size; done += chunk)
+      memcpy(dest + done, dest, size - done < chunk ? size - done : chunk);
+  }
+
+/* A pixel-value with every byte set to the same value */
+static unsigned long int pixel_default(const struct pixel_format * format, unsigned char byte)
+  {
+    return pixel_value_max(format) / byte_all_ones * byte;
+  }
+
+static const struct pixel_format * pixel_format_find(const char * name)
+  {
+    unsigned int i;
+
+    for (i = 0; i < countof(pixel_formats); ++i)
+      {
+        if (strcmp(name, pixel_formats[i].name) == 0)
+          return pixel_formats + i;
+      }
+    return NULL;
+  }
+
+static unsigned long int pixel_value_max(const struct pixel_format * format)
+  {
+    /* Avoid shifting by the full width of the type */
+    return ((1UL << (format->bytes_per_pixel * CHAR_BIT - 1)) - 1) * 2 + 1;
+  }
+
+static void printable_chars(void)
+  {
+    int i;
+
+    for (i = 0; i < byte_value_cnt; ++i)
+      {
+        if (isprint(i))
+          printf("%d 0x%02X %c\n", i, i, i);
+      }
+  }
+
+static void raster_pool_start(struct framebuffer * fb, unsigned int thread_count)
+  {
+    unsigned int i;
+    struct raster_pool * pool;
+
+    /* The calling thread draws the first band itself */
+    fb->pool = NULL;
+    if (thread_count <= 1)
+      return;
+    pool = malloc(sizeof *pool);
+    if (pool != NULL)
+      {
+        pool->workers = malloc((thread_count - 1) * sizeof *pool->workers);
+        if (pool->workers == NULL)
+          {
+            free(pool);
+            pool = NULL;
+          }
+      }
+    if (pool == NULL)
+      {
+        fprintf(stderr, "Unable to allocate render threads\n");
+        exit(EXIT_FAILURE);
+      }
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->layout = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->pending = 0;
+    pool->quit = 0;
+    pthread_cond_init(&pool->start, NULL);
+    pool->thread_count = 0;
+    fb->pool = pool;
+    for (i = 0; i < thread_count - 1; ++i)
+      {
+        pool->workers[i].fb = fb;
+        pool->workers[i].index = i + 1;
+        if (pthread_create(&pool->workers[i].thread, NULL, raster_worker_main, pool->workers + i) != 0)
+          {
+            fprintf(stderr, "Unable to start render thread %u\n", i + 1);
+            exit(EXIT_FAILURE);
+          }
+        ++pool->thread_count;
+      }
+  }
+
+static void raster_pool_stop(struct framebuffer * fb)
+  {
+    unsigned int i;
+    struct raster_pool * pool;
+
+    pool = fb->pool;
+    if (pool == NULL)
+      return;
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->thread_count; ++i)
+      pthread_join(pool->workers[i].thread, NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    free(pool->workers);
+    free(pool);
+    fb->pool = NULL;
+  }
+
+static void * raster_worker_main(void * arg)
+  {
+    struct rect band;
+    unsigned long int bands;
+    struct framebuffer * fb;
+    unsigned long int generation;
+    const struct text_layout * layout;
+    struct raster_pool * pool;
+    struct raster_worker * worker;
+
+    worker = arg;
+    fb = worker->fb;
+    pool = fb->pool;
+    generation = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+      {
+        while (!pool->quit && pool->generation == generation)
+          pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+          break;
+        generation = pool->generation;
+        layout = pool->layout;
+        bands = pool->thread_count + 1;
+        pthread_mutex_unlock(&pool->lock);
+        band.height = fb->height * (worker->index + 1) / bands - fb->height * worker->index / bands;
+        band.width = fb->width;
+        band.x = 0;
+        band.y = fb->origin + (fb->height * worker->index / bands);
+        framebuffer_draw_placements(fb, layout->placements, layout->placements + layout->count, &band);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+          pthread_cond_signal(&pool->done);
+      }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+
+/* The part of a inside b, which is empty when they don't overlap */
+static void rect_intersect(const struct rect * a, const struct rect * b, struct rect * intersection)
+  {
+    unsigned long int bottom;
+    unsigned long int right;
+
+    intersection->x = a->x > b->x ? a->x : b->x;
+    intersection->y = a->y > b->y ? a->y : b->y;
+    right = a->x + a->width < b->x + b->width ? a->x + a->width : b->x + b->width;
+    bottom = a->y + a->height < b->y + b->height ? a->y + a->height : b->y + b->height;
+    intersection->width = right > intersection->x ? right - intersection->x : 0;
+    intersection->height = bottom > intersection->y ? bottom - intersection->y : 0;
+  }
+
+/* Counts the glyphs which have pixels inside clip, and those pixels */
+static void render_stats_draw(struct render_stats * stats, const struct framebuffer * fb, const struct glyph_placement * placement, const struct glyph_placement * placement_end, const struct rect * clip)
+  {
+    unsigned long int x_begin;
+    unsigned long int x_end;
+    unsigned long int y_begin;
+    unsigned long int y_end;
+
+    for (; placement < placement_end; ++placement)
+      {
+        x_begin = placement->x < clip->x ? clip->x : placement->x;
+        x_end = placement->x + fb->font->width * fb->font_scale;
+        if (x_end > clip->x + clip->width)
+          x_end = clip->x + clip->width;
+        y_begin = placement->y < clip->y ? clip->y : placement->y;
+        y_end = placement->y + fb->font->height * fb->font_scale;
+        if (y_end > clip->y + clip->height)
+          y_end = clip->y + clip->height;
+        if (x_begin >= x_end || y_begin >= y_end)
+          continue;
+        ++stats->glyphs;
+        stats->pixels += (x_end - x_begin) * (y_end - y_begin);
+      }
+  }
+
+static void render_stats_init(struct render_stats * stats)
+  {
+    unsigned int phase;
+
+    stats->glyphs = 0;
+    stats->hwraps = 0;
+    stats->newlines = 0;
+    for (phase = 0; phase < phase_cnt; ++phase)
+      stats->phase_time[phase] = 0;
+    stats->pixels = 0;
+    stats->vwraps = 0;
+  }
+
+/* Counts the line breaks of a layout which was drawn */
+static void render_stats_layout(struct render_stats * stats, const struct text_layout * layout)
+  {
+    stats->hwraps += layout->hwraps;
+    stats->newlines += layout->newlines;
+    stats->vwraps += layout->vwraps;
+  }
+
+/* Counts glyphs redrawn inside damaged rectangles, where every pixel is rewritten */
+static void render_stats_rects(struct render_stats * stats, const struct rect * rect, const struct rect * rect_end, unsigned long int glyphs)
+  {
+    stats->glyphs += glyphs;
+    for (; rect < rect_end; ++rect)
+      stats->pixels += rect->width * rect->height;
+  }
+
+/* Writes the collected stats to stderr, as one line of text or of JSON */
+static void render_stats_report(const struct render_stats * stats, const char * report)
+  {
+    int json;
+    unsigned int phase;
+
+    json = strcmp(report, "json") == 0;
+    fprintf(stderr, json ? "{" : "stats:");
+    for (phase = 0; phase < phase_cnt; ++phase)
+      fprintf(stderr, json ? "\"%s_s\":%.6f," : " %s %.6fs", phase_names[phase], stats->phase_time[phase]);
+    fprintf(stderr, json ? "\"glyphs\":%lu,\"pixels\":%lu," : " glyphs %lu pixels %lu", stats->glyphs, stats->pixels);
+    fprintf(stderr, json ? "\"hwraps\":%lu,\"vwraps\":%lu," : " hwraps %lu vwraps %lu", stats->hwraps, stats->vwraps);
+    fprintf(stderr, json ? "\"newlines\":%lu}\n" : " newlines %lu\n", stats->newlines);
+  }
+
+/* Only reads the clock when stats are being collected */
+static double render_stats_start(const struct render_stats * stats)
+  {
+    return stats != NULL ? monotonic_time() : 0;
+  }
+
+static void render_stats_stop(struct render_stats * stats, unsigned int phase, double start)
+  {
+    if (stats != NULL)
+      stats->phase_time[phase] += monotonic_time() - start;
+  }
+
+static void rgb_from_indexed8(const unsigned char * pixel, unsigned char * rgb)
+  {
+    rgb[0] = rgb[1] = rgb[2] = pixel[0];
+  }
+
+static void rgb_from_rgb565(const unsigned char * pixel, unsigned char * rgb)
+  {
+    unsigned int value;
+
+    value = pixel[0] | (pixel[1] << CHAR_BIT);
+    rgb[0] = (((value >> 11) & 0x1F) * 255 + 15) / 31;
+    rgb[1] = (((value >> 5) & 0x3F) * 255 + 31) / 63;
+    rgb[2] = ((value & 0x1F) * 255 + 15) / 31;
+  }
+
+static void rgb_from_rgb888(const unsigned char * pixel, unsigned char * rgb)
+  {
+    memcpy(rgb, pixel, 3);
+  }
+
+static void rgb_from_xrgb8888(const unsigned char * pixel, unsigned char * rgb)
+  {
+    rgb[0] = pixel[2];
+    rgb[1] = pixel[1];
+    rgb[2] = pixel[0];
+  }
+
+/*
+ * Checks the fast paths against plain per-pixel copies: each fill, and the doubling fill forced even for
+ * short runs, for every run length up to a chunk, then every glyph at each font-scale up to
+ * max_selftest_scale, with and without --mono. Every format is tried with colours of one repeated byte and
+ * of different bytes. Reports and returns how many checks failed
+ */
+static unsigned long int selftest(const struct font * font)
+  {
+    unsigned long int checks;
+    unsigned int colours;
+    struct rect cell;
+    unsigned long int count;
+    unsigned char * expect;
+    unsigned long int failures;
+    struct framebuffer fb;
+    const struct pixel_format * format;
+    struct rect full;
+    unsigned char * got;
+    const unsigned char * glyph;
+    unsigned int glyph_index;
+    unsigned long int line_size;
+    int mono;
+    struct write_options options;
+    unsigned char pixel[max_bytes_per_pixel];
+    unsigned long int row;
+    unsigned long int scale;
+    unsigned long int x;
+    unsigned long int y;
+
+    line_size = ((unsigned long int) max_glyph_width * max_selftest_scale + selftest_offsets) * max_bytes_per_pixel;
+    if (line_size < (pixel_fill_chunk + 1UL) * max_bytes_per_pixel)
+      line_size = (pixel_fill_chunk + 1UL) * max_bytes_per_pixel;
+    expect = malloc(line_size);
+    got = malloc(line_size);
+    if (expect == NULL || got == NULL)
+      {
+        fprintf(stderr, "Unable to allocate self-test buffers\n");
+        exit(EXIT_FAILURE);
+      }
+    checks = 0;
+    failures = 0;
+    options.clip = NULL;
+    options.fallback = invalid_codepoint;
+    options.font = font;
+    options.frames = 0;
+    options.height = font->height * max_selftest_scale;
+    options.label_count = 0;
+    options.labels = NULL;
+    options.output = output_encoders;
+    options.pipeline = 0;
+    options.scroll = 0;
+    options.stats = NULL;
+    options.stream = 0;
+    options.target = NULL;
+    options.threads = 1;
+    options.utf8 = 0;
+    options.width = font->width * max_selftest_scale + selftest_offsets;
+    for (format = pixel_formats; format < pixel_formats + countof(pixel_formats); ++format)
+      {
+        options.format = format;
+        for (colours = 0; colours < 2; ++colours)
+          {
+            options.bg = colours == 0 ? pixel_default(format, default_pixel_off) : 0x9ABCDEF0UL & pixel_value_max(format);
+            options.fg = colours == 0 ? pixel_default(format, default_pixel_on) : 0x12345678UL & pixel_value_max(format);
+            pixel_encode(format, options.fg, pixel);
+            /* The bytes past the run must be left alone */
+            for (count = 0; count <= pixel_fill_chunk; ++count)
+              {
+                memset(expect, byte_all_ones, (count + 1) * format->bytes_per_pixel);
+                for (x = 0; x < count; ++x)
+                  memcpy(expect + (x * format->bytes_per_pixel), pixel, format->bytes_per_pixel);
+                memset(got, byte_all_ones, (count + 1) * format->bytes_per_pixel);
+                format->fill(got, pixel, count);
+                checks += 2;
+                if (memcmp(got, expect, (count + 1) * format->bytes_per_pixel) != 0)
+                  {
+                    fprintf(stderr, "selftest: %s fill of %lu pixels differs\n", format->name, count);
+                    ++failures;
+                  }
+                memset(got, byte_all_ones, (count + 1) * format->bytes_per_pixel);
+                if (count != 0)
+                  pixel_fill_repeat(got, pixel, format->bytes_per_pixel, count);
+                if (memcmp(got, expect, (count + 1) * format->bytes_per_pixel) != 0)
+                  {
+                    fprintf(stderr, "selftest: %s doubling fill of %lu pixels differs\n", format->name, count);
+                    ++failures;
+                  }
+              }
+            for (mono = 0; mono < 2; ++mono)
+              {
+                options.mono = mono;
+                for (scale = 1; scale <= max_selftest_scale; ++scale)
+                  {
+                    options.scale = scale;
+                    framebuffer_init(&fb, &options);
+                    full.height = fb.height;
+                    full.width = fb.width;
+                    full.x = 0;
+                    full.y = 0;
+                    cell.height = font->height * scale;
+                    cell.width = font->width * scale;
+                    cell.y = 0;
+                    for (glyph_index = 0; glyph_index <= font->count; ++glyph_index)
+                      {
+                        /* Glyphs start a few pixels apart, so mono bits are shifted by each amount */
+                        cell.x = glyph_index % selftest_offsets;
+                        framebuffer_draw_glyph(&fb, glyph_index, cell.x, cell.y, &full);
+                        glyph = glyph_index < font->count ? font->glyphs + (glyph_index * font->bytes_per_glyph) : NULL;
+                        /* One more pixel-line and column than the cell show whether it was overrun */
+                        for (y = 0; y <= cell.height && y < fb.height; ++y)
+                          {
+                            row = y < cell.height ? font_row(font, glyph, y / scale) : 0;
+                            for (x = 0; x <= cell.x + cell.width; ++x)
+                              memcpy(expect + (x * fb.bytes_per_pixel), x >= cell.x && x < cell.x + cell.width && ((row >> ((x - cell.x) / scale)) & 1) != 0 ? fb.pixel_on : fb.pixel_off, fb.bytes_per_pixel);
+                            ++checks;
+                            if (memcmp(framebuffer_pixels(&fb, 0, y, x), expect, x * fb.bytes_per_pixel) != 0)
+                              {
+                                fprintf(stderr, "selftest: %s%s glyph %u at font-scale %lu differs on pixel-line %lu\n", format->name, mono ? " mono" : "", glyph_index, scale, y);
+                                ++failures;
+                                break;
+                              }
+                          }
+                        framebuffer_clear_rect(&fb, &cell);
+                      }
+                    framebuffer_free(&fb);
+                  }
+              }
+          }
+      }
+    free(expect);
+    free(got);
+    printf("selftest: %lu checks, %lu failed\n", checks, failures);
+    return failures;
+  }
+
+static int serve(const char * socket_path, unsigned long int workers, const struct font * font)
+  {
+    struct sockaddr_un addr;
+    unsigned long int i;
+    int last_errno;
+    int listen_fd;
+    struct serve_worker * pool;
+    int sig;
+    sigset_t signals;
+    struct stat st;
+    int wake[2];
+
+    pool = malloc(workers * sizeof *pool);
+    if (pool == NULL)
+      {
+        fprintf(stderr, "Unable to allocate serve workers\n");
+        return EXIT_FAILURE;
+      }
+    for (i = 0; i < workers; ++i)
+      {
+        pool[i].clock = 0;
+        pool[i].conn_fd = -1;
+        memset(pool[i].fb_last_used, 0, sizeof pool[i].fb_last_used);
+        pool[i].font = font;
+        pool[i].listen_fd = -1;
+        pool[i].stopping = 0;
+        pool[i].wake_fd = -1;
+      }
+    /* Without a socket, serve stdin and stdout, one request after another */
+    if (socket_path == NULL)
+      {
+        serve_connection(pool, stdin, stdout);
+        serve_worker_free(pool);
+        free(pool);
+        return EXIT_SUCCESS;
+      }
+    if (strlen(socket_path) >= sizeof addr.sun_path)
+      {
+        fprintf(stderr, "Socket path too long\n");
+        free(pool);
+        return EXIT_FAILURE;
+      }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    /* A socket left behind by a server which is gone is replaced, but not one which is still answering */
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+      {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd >= 0 && connect(listen_fd, (struct sockaddr *) &addr, sizeof addr) != 0 && errno == ECONNREFUSED)
+          unlink(socket_path);
+        if (listen_fd >= 0)
+          close(listen_fd);
+      }
+    /* Workers wait for connections without blocking in accept(), so that they can be woken to stop */
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) != 0 || listen(listen_fd, SOMAXCONN) != 0 || fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0 || pipe(wake) != 0)
+      {
+        last_errno = errno;
+        fprintf(stderr, "Unable to listen on '%s':\n  errno:           %d\n  strerror(errno): %s\n", socket_path, last_errno, strerror(last_errno));
+        if (listen_fd >= 0)
+          close(listen_fd);
+        free(pool);
+        return EXIT_FAILURE;
+      }
+    /* A client going away must not end the server */
+    signal(SIGPIPE, SIG_IGN);
+    /* Only this thread takes the signals to stop; the workers inherit them blocked */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    /* Each worker accepts and serves one connection at a time */
+    for (i = 0; i < workers; ++i)
+      {
+        pool[i].listen_fd = listen_fd;
+        pthread_mutex_init(&pool[i].lock, NULL);
+        pool[i].wake_fd = wake[0];
+        if (pthread_create(&pool[i].thread, NULL, serve_worker_main, pool + i) != 0)
+          {
+            fprintf(stderr, "Unable to start serve worker %lu\n", i + 1);
+            exit(EXIT_FAILURE);
+          }
+      }
+    while (sigwait(&signals, &sig) != 0)
+      ;
+    /*
+     * Connections being served stop being read, so each ends after the request in hand, and the wake pipe,
+     * never read from, stays readable for every worker waiting for a connection
+     */
+    for (i = 0; i < workers; ++i)
+      {
+        pthread_mutex_lock(&pool[i].lock);
+        pool[i].stopping = 1;
+        if (pool[i].conn_fd >= 0)
+          shutdown(pool[i].conn_fd, SHUT_RD);
+        pthread_mutex_unlock(&pool[i].lock);
+      }
+    if (write(wake[1], "", 1) != 1)
+      perror("write()");
+    for (i = 0; i < workers; ++i)
+      {
+        pthread_join(pool[i].thread, NULL);
+        pthread_mutex_destroy(&pool[i].lock);
+        serve_worker_free(pool + i);
+      }
+    close(wake[0]);
+    close(wake[1]);
+    close(listen_fd);
+    unlink(socket_path);
+    free(pool);
+    return EXIT_SUCCESS;
+  }
+
+/*
+ * Handles requests until the end of the input. Each request is a header line:
+ *   <width> <height> <scale> <format> <output> <length>
+ * followed by <length> bytes of text. Each response is "OK <length>" or "ERROR <length>" on a line,
+ * followed by <length> bytes of encoded framebuffer or of error message
+ */
+static void serve_connection(struct serve_worker * worker, FILE * in, FILE * out)
+  {
+    struct framebuffer * fb;
+    char format[max_serve_name_len + 1];
+    unsigned long int len;
+    char line[max_serve_header_len];
+    const char * msg;
+    struct write_options options;
+    char output[max_serve_name_len + 1];
+    struct text_buffer response;
+    struct text_buffer text;
+
+    text_buffer_init(&response);
+    text_buffer_init(&text);
+    while (fgets(line, sizeof line, in) != NULL)
+      {
+        if (strchr(line, '\n') == NULL || sscanf(line, "%lu %lu %lu %31s %31s %lu", &options.width, &options.height, &options.scale, format, output, &len) != 6)
+          {
+            msg = "Malformed request header";
+            serve_respond(out, "ERROR", msg, strlen(msg));
+            break;
+          }
+        if (len > max_serve_text_len)
+          {
+            msg = "Request text too long";
+            serve_respond(out, "ERROR", msg, strlen(msg));
+            break;
+          }
+        /* Read the text, even if the request turns out to be bad, so the next one can be read */
+        text.len = 0;
+        text_buffer_reserve(&text, len);
+        if (len != 0 && fread(text.buf, 1, len, in) != len)
+          {
+            msg = "Truncated request text";
+            serve_respond(out, "ERROR", msg, strlen(msg));
+            break;
+          }
+        text.len = len;
+        options.format = pixel_format_find(format);
+        options.output = output_encoder_find(output);
+        msg = NULL;
+        /*
+         * A glyph must fit in the framebuffer, which also keeps the font-scale well inside an unsigned
+         * int and the glyph cache's rows within the framebuffer limit, so a request can't ask for
+         * unbounded memory
+         */
+        if (options.width == 0 || options.height == 0 || options.scale == 0)
+          msg = "Width, height and scale must be positive";
+          else if (options.height > max_serve_pixels / options.width)
+          msg = "Framebuffer too large";
+          else if (options.scale > options.width / worker->font->width || options.scale > options.height / worker->font->height)
+          msg = "Scale too large for the framebuffer";
+          else if (options.format == NULL)
+          msg = "Unknown format";
+          else if (options.output == NULL)
+          msg = "Unknown output";
+        if (msg != NULL)
+          {
+            serve_respond(out, "ERROR", msg, strlen(msg));
+            continue;
+          }
+        options.bg = pixel_default(options.format, default_pixel_off);
+        options.fg = pixel_default(options.format, default_pixel_on);
+        options.clip = NULL;
+        options.fallback = invalid_codepoint;
+        options.font = worker->font;
+        options.frames = 0;
+        options.label_count = 0;
+        options.labels = NULL;
+        options.mono = 0;
+        options.pipeline = 0;
+        options.scroll = 0;
+        options.stream = 0;
+        options.target = NULL;
+        options.threads = 1;
+        options.utf8 = 0;
+        /* A kept framebuffer only needs the glyphs which differ from its last request redrawn */
+        fb = serve_framebuffer(worker, &options);
+        framebuffer_update(fb, text.buf, text.len);
+        response.len = 0;
+        output_frame(options.output, fb, &response, NULL);
+        serve_respond(out, "OK", response.buf, response.len);
+      }
+    text_buffer_free(&response);
+    text_buffer_free(&text);
+  }
+
+/* Finds a kept framebuffer for the request, or replaces the least recently used one */
+static struct framebuffer * serve_framebuffer(struct serve_worker * worker, const struct write_options * options)
+  {
+    struct framebuffer * fb;
+    unsigned long int i;
+    unsigned long int oldest;
+
+    oldest = 0;
+    for (i = 0; i < max_serve_framebuffers; ++i)
+      {
+        fb = worker->fbs + i;
+        if (worker->fb_last_used[i] != 0 && fb->width == options->width && fb->height == options->height && fb->font_scale == options->scale && fb->format == options->format)
+          {
+            worker->fb_last_used[i] = ++worker->clock;
+            return fb;
+          }
+        if (worker->fb_last_used[i] < worker->fb_last_used[oldest])
+          oldest = i;
+      }
+    fb = worker->fbs + oldest;
+    if (worker->fb_last_used[oldest] != 0)
+      framebuffer_free(fb);
+    framebuffer_init(fb, options);
+    worker->fb_last_used[oldest] = ++worker->clock;
+    return fb;
+  }
+
+static void serve_respond(FILE * out, const char * status, const char * data, unsigned long int len)
+  {
+    fprintf(out, "%s %lu\n", status, len);
+    if (len != 0)
+      fwrite(data, 1, len, out);
+    fflush(out);
+  }
+
+static void serve_worker_free(struct serve_worker * worker)
+  {
+    unsigned int i;
+
+    for (i = 0; i < max_serve_framebuffers; ++i)
+      {
+        if (worker->fb_last_used[i] != 0)
+          framebuffer_free(worker->fbs + i);
+        worker->fb_last_used[i] = 0;
+      }
+  }
+
+static void * serve_worker_main(void * arg)
+  {
+    int fd;
+    struct pollfd fds[2];
+    FILE * in;
+    FILE * out;
+    int stopping;
+    struct serve_worker * worker;
+
+    worker = arg;
+    fds[0].fd = worker->listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = worker->wake_fd;
+    fds[1].events = POLLIN;
+    for (;;)
+      {
+        if (poll(fds, countof(fds), -1) < 0)
           {
-            fgets_status("NULL", line, font_file);
+            if (errno == EINTR)
+              continue;
+            perror("poll()");
             break;
           }
-        /* It must end with the character to be represented, then a newline */
-        search = strchr(buf, '\n');
-        if (search == NULL || search == buf)
-          {
-            fprintf(stderr, "Expected printable character, then newline on line %d\n", line);
-            exit(EXIT_FAILURE);
-          }
-        /* The previous character needs to be printable */
-        if (!isprint(search[-1]))
+        if (fds[1].revents != 0)
+          break;
+        /* Another worker may have taken the connection first */
+        fd = accept(worker->listen_fd, NULL, NULL);
+        if (fd < 0)
           {
-            fprintf(stderr, "Expected printable character before newline on line %d\n", line);
-            exit(EXIT_FAILURE);
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+              continue;
+            perror("accept()");
+            break;
           }
-        /* Now we know the index of the character */
-        character = *(unsigned char *) (search - 1);
-        /* Clear all bits for the character */
-        for (j = 0; j < bytes_per_font_character; ++j)
-          packed_encodings[character][j] = byte_all_zeroes;
-        /* Read the pixels */
-        bit_pos = 0;
-        for (pixel_line = 0; pixel_line < font_height; ++pixel_line)
+        /* Some systems pass the listening socket's O_NONBLOCK on, but connections are read blocking */
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        pthread_mutex_lock(&worker->lock);
+        stopping = worker->stopping;
+        if (!stopping)
+          worker->conn_fd = fd;
+        pthread_mutex_unlock(&worker->lock);
+        if (stopping)
           {
-            ++line;
-            errno = 0;
-            ret = fgets(buf, sizeof buf, font_file);
-            if (ret == NULL)
-              {
-                fgets_status("NULL", line, font_file);
-                fprintf(stderr, "Expected line of pixels of '0' or '1' on line %d\n", line);
-                exit(EXIT_FAILURE);
-              }
-            line_len = strlen(ret);
-            if (line_len < font_width || (line_len > font_width && buf[font_width] != '\n'))
-              {
-                fprintf(stderr, "Expected %d pixels of '0' or '1' on line %d\n", font_width, line);
-                exit(EXIT_FAILURE);
-              }
-            /* Process each pixel */
-            for (pixel = 0; pixel < font_width; ++pixel)
-              {
-                if (buf[pixel] != '0' && buf[pixel] != '1')
-                  {
-                    fprintf(stderr, "Expected '0' or '1' for pixel %d on line %d\n", pixel + 1, line);
-                    exit(EXIT_FAILURE);
-                  }
-                packed_encodings[character][bit_pos / CHAR_BIT] |= (buf[pixel] == '0' ? 0 : 1) << (bit_pos % CHAR_BIT);
-                ++bit_pos;
-              }
-            if (feof(font_file) || ferror(font_file))
-              {
-                fgets_status("OK", line, font_file);
-                break;
-              }
+            close(fd);
+            break;
           }
-        /* Did we get all pixel-lines? */
-        if (pixel_line < font_height)
+        in = fdopen(fd, "rb");
+        fd = dup(fd);
+        out = fd < 0 ? NULL : fdopen(fd, "wb");
+        if (in == NULL || out == NULL)
           {
-            fprintf(stderr, "Expected %d more lines of pixels after line %d\n", (font_height - 1) - pixel_line, line);
-            exit(EXIT_FAILURE);
+            perror("fdopen()");
+            if (out == NULL && fd >= 0)
+              close(fd);
           }
-        if (feof(font_file) || ferror(font_file))
+          else
           {
-            fgets_status("OK", line, font_file);
-            break;
+            serve_connection(worker, in, out);
           }
+        pthread_mutex_lock(&worker->lock);
+        worker->conn_fd = -1;
+        pthread_mutex_unlock(&worker->lock);
+        if (in != NULL)
+          fclose(in);
+        if (out != NULL)
+          fclose(out);
       }
-    /* All done */
-    printf("Font encodes as these bytes: ");
-    i = 0;
-    goto jump_in;
-    for (; i < countof(packed_encodings); ++i)
+    return NULL;
+  }
+
+static void simulation(const struct write_options * options, FILE * simulation_file)
+  {
+    struct framebuffer fb;
+    unsigned long int frame;
+    struct text_buffer frame_text;
+    const char * ftptr;
+    struct input in;
+    int last_errno;
+    unsigned long int len;
+    int more;
+    struct text_buffer out;
+    const char * span;
+    double start;
+    struct render_stats stats;
+
+    last_errno = errno;
+
+    render_stats_init(&stats);
+    start = render_stats_start(options->stats != NULL ? &stats : NULL);
+    framebuffer_init(&fb, options);
+    if (options->stats != NULL)
+      fb.stats = &stats;
+    render_stats_stop(fb.stats, phase_clear, start);
+    frame = 0;
+    text_buffer_init(&frame_text);
+    text_buffer_init(&out);
+    /* Read and write all input */
+    input_open(&in, simulation_file);
+    for (;;)
       {
-        printf(", ");
-        jump_in:
-        j = 0;
-        goto jump_in2;
-        for (; j < bytes_per_font_character; ++j)
+        start = render_stats_start(fb.stats);
+        more = input_next(&in, &span, &len);
+        render_stats_stop(fb.stats, phase_input, start);
+        if (!more)
+          break;
+        if (options->stream != 0)
           {
-            printf(", ");
-            jump_in2:
-            printf("%d", packed_encodings[i][j]);
+            text_buffer_append(&frame_text, span, len);
+            continue;
+          }
+        if (!options->frames)
+          {
+            start = render_stats_start(fb.stats);
+            framebuffer_write(&fb, span, len, 0);
+            render_stats_stop(fb.stats, phase_render, start);
+            continue;
+          }
+        /* Each form-feed ends a frame */
+        while ((ftptr = memchr(span, '\f', len)) != NULL)
+          {
+            text_buffer_append(&frame_text, span, ftptr - span);
+            simulation_frame(options, &fb, &out, frame_text.buf, frame_text.len, ++frame);
+            frame_text.len = 0;
+            len -= ftptr + 1 - span;
+            span = ftptr + 1;
           }
+        text_buffer_append(&frame_text, span, len);
       }
-    printf("\n");
+    input_close(&in);
+    /* Display the content of the framebuffer */
+    if (options->stream != 0)
+      simulation_stream(options, &fb, &out, frame_text.buf, frame_text.len);
+      else if (!options->frames)
+      {
+        start = render_stats_start(fb.stats);
+        /* Input which ends part way through a sequence still draws it, as an invalid character */
+        if (fb.decoder.pending != 0)
+          framebuffer_write(&fb, "", 0, 1);
+        simulation_labels(options, &fb);
+        render_stats_stop(fb.stats, phase_render, start);
+        start = render_stats_start(fb.stats);
+        if (options->target != NULL)
+          framebuffer_sync(&fb);
+          else
+          output_frame(options->output, &fb, &out, stdout);
+        render_stats_stop(fb.stats, phase_display, start);
+      }
+      else if (frame_text.len != 0 || frame == 0)
+      simulation_frame(options, &fb, &out, frame_text.buf, frame_text.len, ++frame);
+    if (fb.stats != NULL)
+      render_stats_report(fb.stats, options->stats);
+    text_buffer_free(&frame_text);
+    text_buffer_free(&out);
+    framebuffer_free(&fb);
     errno = last_errno;
   }
 
-static void printable_chars(void)
+/* Draws one frame of --frames input, then outputs it; after the first frame, ASCII output only shows what changed */
+static void simulation_frame(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, const char * text, unsigned long int len, unsigned long int frame)
   {
-    int i;
+    double start;
 
-    for (i = 0; i < byte_value_cnt; ++i)
+    start = render_stats_start(fb->stats);
+    framebuffer_update(fb, text, len);
+    simulation_labels(options, fb);
+    render_stats_stop(fb->stats, phase_render, start);
+    simulation_display(options, fb, out, frame);
+  }
+
+/* Outputs a drawn --frames frame, or after the first frame in ASCII, the rectangles in its damage list */
+static void simulation_display(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, unsigned long int frame)
+  {
+    double start;
+
+    start = render_stats_start(fb->stats);
+    if (options->target != NULL)
+      framebuffer_sync(fb);
+      else if (frame == 1 || options->output != output_encoders)
+      output_frame(options->output, fb, out, stdout);
+      else
       {
-        if (isprint(i))
-          printf("%d 0x%02X %c\n", i, i, i);
+        display_damage(out, fb, frame);
+        output_flush(out, stdout);
       }
+    render_stats_stop(fb->stats, phase_display, start);
   }
 
-static void simulation(unsigned long int width, unsigned long int height, unsigned long int scale, FILE * simulation_file)
+/*
+ * Draws the --label texts over the frame. Labels are drawn again after every update, and damage only
+ * ever uncovers pixels which are redrawn here, so the displayed rectangles stay correct
+ */
+static void simulation_labels(const struct write_options * options, struct framebuffer * fb)
   {
-    char buf[max_write_line];
-    unsigned long int byte_pos;
-    char * cptr;
-    struct framebuffer fb;
+    const struct label * label;
+
+    for (label = options->labels; label < options->labels + options->label_count; ++label)
+      framebuffer_draw_at(fb, label->x, label->y, label->text, strlen(label->text), options->clip);
+  }
+
+/*
+ * Runs --frames as a pipeline: this thread reads and splits the input, while one thread draws frames and
+ * another outputs them, so frames go through at about the speed of the slowest stage
+ */
+static void simulation_pipeline(const struct write_options * options, FILE * simulation_file)
+  {
+    pthread_t display_thread;
+    const char * ftptr;
+    unsigned int i;
+    struct input in;
     int last_errno;
-    int line;
-    char * ret;
-    unsigned long int x;
-    unsigned long int y;
+    unsigned long int len;
+    int more;
+    struct pipeline pipe;
+    pthread_t render_thread;
+    struct pipeline_slot * slot;
+    const char * span;
+    double start;
+    struct render_stats stats;
 
     last_errno = errno;
 
-    /* Initialize framebuffer */
-    fb.bytes_per_pixel = bits_per_pixel / CHAR_BIT;
-    fb.cur_x = 0;
-    fb.cur_y = 0;
-    fb.font_scale = scale;
-    fb.height = height;
-    fb.width = width;
-    fb.buf = malloc(width * height * fb.bytes_per_pixel);
-    if (fb.buf == NULL)
+    render_stats_init(&stats);
+    start = render_stats_start(options->stats != NULL ? &stats : NULL);
+    for (i = 0; i < pipeline_slots; ++i)
       {
-        fprintf(stderr, "Simulation unable to allocate memory\n");
+        framebuffer_init(&pipe.slots[i].fb, options);
+        if (options->stats != NULL)
+          pipe.slots[i].fb.stats = &stats;
+        text_buffer_init(&pipe.slots[i].text);
+      }
+    render_stats_stop(pipe.slots[0].fb.stats, phase_clear, start);
+    pthread_cond_init(&pipe.changed, NULL);
+    pipe.displayed = 0;
+    pthread_mutex_init(&pipe.lock, NULL);
+    pipe.options = options;
+    pipe.read = 0;
+    pipe.reading = 1;
+    pipe.rendered = 0;
+    if (pthread_create(&render_thread, NULL, pipeline_render_main, &pipe) != 0 || pthread_create(&display_thread, NULL, pipeline_display_main, &pipe) != 0)
+      {
+        fprintf(stderr, "Unable to start pipeline threads\n");
         exit(EXIT_FAILURE);
       }
+    /* Each form-feed ends a frame, which is handed on once a slot is free for the next */
+    slot = pipe.slots;
+    input_open(&in, simulation_file);
+    for (;;)
+      {
+        start = render_stats_start(slot->fb.stats);
+        more = input_next(&in, &span, &len);
+        render_stats_stop(slot->fb.stats, phase_input, start);
+        if (!more)
+          break;
+        while ((ftptr = memchr(span, '\f', len)) != NULL)
+          {
+            text_buffer_append(&slot->text, span, ftptr - span);
+            pipeline_advance(&pipe, &pipe.read);
+            slot = pipe.slots + pipe.read % pipeline_slots;
+            slot->text.len = 0;
+            len -= ftptr + 1 - span;
+            span = ftptr + 1;
+          }
+        text_buffer_append(&slot->text, span, len);
+      }
+    input_close(&in);
+    pthread_mutex_lock(&pipe.lock);
+    if (slot->text.len != 0 || pipe.read == 0)
+      ++pipe.read;
+    pipe.reading = 0;
+    pthread_cond_broadcast(&pipe.changed);
+    pthread_mutex_unlock(&pipe.lock);
+    pthread_join(render_thread, NULL);
+    pthread_join(display_thread, NULL);
+    if (options->stats != NULL)
+      render_stats_report(&stats, options->stats);
+    pthread_cond_destroy(&pipe.changed);
+    pthread_mutex_destroy(&pipe.lock);
+    for (i = 0; i < pipeline_slots; ++i)
+      {
+        text_buffer_free(&pipe.slots[i].text);
+        framebuffer_free(&pipe.slots[i].fb);
+      }
+    errno = last_errno;
+  }
+
+/*
+ * Lays out all of the text, then draws and outputs the framebuffer one band of text rows at a time, so
+ * only a band is ever held. Without vertical wraps, placements only go down the framebuffer, so each
+ * band only looks at the placements which reach into it
+ */
+static void simulation_stream(const struct write_options * options, struct framebuffer * fb, struct text_buffer * out, const char * text, unsigned long int len)
+  {
+    struct rect band;
+    struct rect clip;
+    const struct glyph_placement * first;
+    unsigned long int glyph_height;
+    const struct label * label;
+    const struct glyph_placement * last;
+    const struct glyph_placement * placement_end;
+    double start;
+    unsigned long int y;
 
-    /* Turn all pixels off */
-    for (y = 0; y < height; ++y)
+    start = render_stats_start(fb->stats);
+    text_layout_build(&fb->layout, fb, text, len, 1);
+    if (fb->stats != NULL)
+      render_stats_layout(fb->stats, &fb->layout);
+    render_stats_stop(fb->stats, phase_render, start);
+    if (options->output->begin != NULL)
+      options->output->begin(out, fb);
+    glyph_height = fb->font->height * fb->font_scale;
+    first = fb->layout.placements;
+    placement_end = fb->layout.placements + fb->layout.count;
+    last = placement_end;
+    band.width = fb->width;
+    band.x = 0;
+    for (band.y = 0; band.y < fb->height; band.y += band.height)
       {
-        for (x = 0; x < width; ++x)
+        start = render_stats_start(fb->stats);
+        band.height = fb->buf_lines < fb->height - band.y ? fb->buf_lines : fb->height - band.y;
+        fb->buf_y = band.y;
+        framebuffer_clear(fb);
+        if (!fb->layout.wrapped)
           {
-            byte_pos = (width * fb.bytes_per_pixel * y) + (x * fb.bytes_per_pixel);
-            memcpy(fb.buf + byte_pos, pixel_off, fb.bytes_per_pixel);
+            while (first < placement_end && first->y + glyph_height <= band.y)
+              ++first;
+            for (last = first; last < placement_end && last->y < band.y + band.height; ++last)
+              ;
           }
+        framebuffer_draw_placements(fb, first, last, &band);
+        if (fb->stats != NULL)
+          render_stats_draw(fb->stats, fb, first, last, &band);
+        for (label = options->labels; label < options->labels + options->label_count; ++label)
+          {
+            clip = band;
+            if (options->clip != NULL)
+              rect_intersect(&band, options->clip, &clip);
+            framebuffer_draw_at(fb, label->x, label->y, label->text, strlen(label->text), &clip);
+          }
+        render_stats_stop(fb->stats, phase_render, start);
+        start = render_stats_start(fb->stats);
+        for (y = band.y; y < band.y + band.height; ++y)
+          {
+            options->output->row(out, fb, framebuffer_pixels(fb, 0, y, fb->width));
+            if (out->len >= output_flush_size)
+              output_flush(out, stdout);
+          }
+        render_stats_stop(fb->stats, phase_display, start);
       }
-    /* Read and write all input */
-    for (line = 1; 1; ++line)
+    if (options->output->end != NULL)
+      options->output->end(out, fb);
+    output_flush(out, stdout);
+  }
+
+static void text_buffer_append(struct text_buffer * text, const char * src, unsigned long int len)
+  {
+    if (len == 0)
+      return;
+    memcpy(text_buffer_reserve(text, len), src, len);
+    text->len += len;
+  }
+
+static void text_buffer_free(struct text_buffer * text)
+  {
+    free(text->buf);
+    text_buffer_init(text);
+  }
+
+static void text_buffer_init(struct text_buffer * text)
+  {
+    text->buf = NULL;
+    text->capacity = 0;
+    text->len = 0;
+  }
+
+/* Makes room for len more bytes after the current text */
+static char * text_buffer_reserve(struct text_buffer * text, unsigned long int len)
+  {
+    unsigned long int capacity;
+    void * ptr;
+
+    if (text->len + len > text->capacity)
       {
-        errno = 0;
-        ret = fgets(buf, sizeof buf, stdin);
-        if (ret == NULL)
+        capacity = text->capacity * 2;
+        if (capacity < text->len + len)
+          capacity = text->len + len;
+        ptr = realloc(text->buf, capacity);
+        if (ptr == NULL)
           {
-            fgets_status("NULL", line, simulation_file);
-            break;
+            fprintf(stderr, "Unable to allocate text buffer\n");
+            exit(EXIT_FAILURE);
           }
-        framebuffer_write(&fb, buf);
-        if (feof(simulation_file) || ferror(simulation_file))
+        text->buf = ptr;
+        text->capacity = capacity;
+      }
+    return text->buf + text->len;
+  }
+
+/*
+ * Lays out text from the framebuffer's cursor and decoder state. When last is nonzero nothing follows the
+ * text, so a sequence left unfinished at its end gets a glyph of its own
+ */
+static void text_layout_build(struct text_layout * layout, const struct framebuffer * fb, const char * text, unsigned long int len, int last)
+  {
+    unsigned int char_height;
+    unsigned int char_width;
+    unsigned long int codepoint;
+    unsigned int consumed;
+    const unsigned char * cptr;
+    unsigned long int cur_x;
+    unsigned long int cur_y;
+    struct utf8_decoder decoder;
+    const unsigned char * end;
+    unsigned long int hwraps;
+    unsigned long int newlines;
+    unsigned long int origin;
+    struct glyph_placement * placement;
+    void * ptr;
+    unsigned long int rows;
+    unsigned long int vwraps;
+
+    /* There is at most one glyph per character, and one more for a sequence left unfinished at the end */
+    if (len + 1 > layout->capacity)
+      {
+        ptr = realloc(layout->placements, (len + 1) * sizeof *layout->placements);
+        if (ptr == NULL)
           {
-            fgets_status("OK", line, simulation_file);
-            break;
+            fprintf(stderr, "Unable to allocate text layout\n");
+            exit(EXIT_FAILURE);
           }
+        layout->placements = ptr;
+        layout->capacity = len + 1;
       }
-    /* Display the content of the framebuffer */
-    printf("\n+");
-    for (x = 0; x < width; ++x)
-      printf("-");
-    printf("+\n");
-    cptr = (char *) fb.buf;
-    for (y = 0; y < height; ++y)
+    /* Remember what the layout is for, so that it can be reused */
+    if (len > layout->text_capacity)
+      {
+        ptr = realloc(layout->text, len);
+        if (ptr == NULL)
+          {
+            fprintf(stderr, "Unable to allocate text layout\n");
+            exit(EXIT_FAILURE);
+          }
+        layout->text = ptr;
+        layout->text_capacity = len;
+      }
+    /* Empty text may have no buffer to copy into yet */
+    if (len != 0)
+      memcpy(layout->text, text, len);
+    layout->text_len = len;
+    layout->font_scale = fb->font_scale;
+    layout->height = fb->height;
+    layout->last = last;
+    layout->start_decoder = fb->decoder;
+    layout->start_origin = fb->origin;
+    layout->start_x = fb->cur_x;
+    layout->start_y = fb->cur_y;
+    layout->width = fb->width;
+
+    char_height = fb->font->height * fb->font_scale + 1;
+    char_width = fb->font->width * fb->font_scale + 1;
+    cur_x = fb->cur_x;
+    cur_y = fb->cur_y;
+    decoder = fb->decoder;
+    hwraps = 0;
+    origin = fb->origin;
+    /* Scrolling keeps the last of the whole text rows which fit at the bottom */
+    rows = (fb->height + 1) / char_height;
+    if (rows == 0)
+      rows = 1;
+    newlines = 0;
+    vwraps = 0;
+    placement = layout->placements;
+    end = (const unsigned char *) text + len;
+    for (cptr = (const unsigned char *) text; cptr < end || (last && decoder.pending != 0); cptr += consumed)
       {
-        printf("|");
-        for (x = 0; x < width; ++x)
+        /* Without --utf8, and for ASCII, each byte is a character of its own */
+        consumed = 1;
+        if (cptr == end)
+          {
+            /* The last text ends part way through a sequence, which is drawn as an invalid character */
+            consumed = 0;
+            codepoint = invalid_codepoint;
+            utf8_decoder_init(&decoder);
+          }
+          else if (decoder.pending == 0 && (*cptr < utf8_first_multibyte || !fb->utf8))
+          codepoint = *cptr;
+          else
+          {
+            consumed = utf8_decode(&decoder, *cptr, &codepoint);
+            if (decoder.pending != 0)
+              continue;
+          }
+        /* Check for newline or horizontal wrap */
+        if (codepoint == '\n' || cur_x + char_width > fb->width + 1)
           {
-            for (byte_pos = 1; byte_pos < fb.bytes_per_pixel; ++byte_pos)
+            cur_x = 0;
+            cur_y += char_height;
+            if (codepoint == '\n')
               {
-                if (cptr[byte_pos] != *cptr)
-                  {
-                    printf("X");
-                    break;
-                  }
+                ++newlines;
+                continue;
               }
-            if (byte_pos == fb.bytes_per_pixel)
-              printf("%c", *cptr);
-            cptr += fb.bytes_per_pixel;
+            ++hwraps;
+          }
+        /* Check for vertical wrap, or with --scroll, for scrolling */
+        if (cur_y + char_height > origin + fb->height + 1)
+          {
+            if (fb->scroll)
+              origin = cur_y - ((rows - 1) * char_height);
+              else
+              cur_y = 0;
+            ++vwraps;
           }
-        printf("|\n");
+        /* A framebuffer shorter than a glyph shows the top of it, as drawing clips each glyph */
+        placement->glyph = framebuffer_glyph(fb, codepoint);
+        placement->x = cur_x;
+        placement->y = cur_y;
+        ++placement;
+        cur_x += char_width;
       }
-    printf("+");
-    for (x = 0; x < width; ++x)
-      printf("-");
-    printf("+\n");
-    free(fb.buf);
-    errno = last_errno;
+    layout->count = placement - layout->placements;
+    layout->end_decoder = decoder;
+    layout->end_origin = origin;
+    layout->end_x = cur_x;
+    layout->end_y = cur_y;
+    layout->hwraps = hwraps;
+    layout->newlines = newlines;
+    layout->vwraps = vwraps;
+    layout->wrapped = vwraps != 0 && !fb->scroll;
   }
 
-static void unpack_font(void)
+static void text_layout_free(struct text_layout * layout)
+  {
+    free(layout->placements);
+    free(layout->text);
+    text_layout_init(layout);
+  }
+
+static void text_layout_init(struct text_layout * layout)
+  {
+    layout->capacity = 0;
+    layout->count = 0;
+    utf8_decoder_init(&layout->end_decoder);
+    layout->end_origin = 0;
+    layout->end_x = 0;
+    layout->end_y = 0;
+    /* No framebuffer has a zero font-scale, so this layout is never reused */
+    layout->font_scale = 0;
+    layout->height = 0;
+    layout->hwraps = 0;
+    layout->last = 0;
+    layout->newlines = 0;
+    layout->placements = NULL;
+    utf8_decoder_init(&layout->start_decoder);
+    layout->start_origin = 0;
+    layout->start_x = 0;
+    layout->start_y = 0;
+    layout->text = NULL;
+    layout->text_capacity = 0;
+    layout->text_len = 0;
+    layout->vwraps = 0;
+    layout->width = 0;
+    layout->wrapped = 0;
+  }
+
+static int text_layout_reusable(const struct text_layout * layout, const struct framebuffer * fb, const char * text, unsigned long int len, int last)
+  {
+    return
+      layout->font_scale == fb->font_scale &&
+      layout->last == last &&
+      layout->height == fb->height &&
+      layout->width == fb->width &&
+      layout->start_origin == fb->origin &&
+      layout->start_x == fb->cur_x &&
+      layout->start_y == fb->cur_y &&
+      layout->start_decoder.codepoint == fb->decoder.codepoint &&
+      layout->start_decoder.min == fb->decoder.min &&
+      layout->start_decoder.pending == fb->decoder.pending &&
+      layout->text_len == len &&
+      (len == 0 || memcmp(layout->text, text, len) == 0);
+  }
+
+/*
+ * Adds glyphs to the last line, starting with the character at byte start, where each glyph is one byte
+ * of the text when there are several. A glyph which doesn't fit starts a new line, as a horizontal wrap
+ */
+static void text_metrics_add(struct text_metrics * metrics, unsigned long int glyphs, unsigned long int start)
+  {
+    struct text_line * line;
+    unsigned long int take;
+
+    line = metrics->lines + metrics->line_count - 1;
+    while (glyphs != 0)
+      {
+        if (line->glyphs + 1 > metrics->cols)
+          {
+            text_metrics_line(metrics, start);
+            line = metrics->lines + metrics->line_count - 1;
+          }
+        /* A glyph wider than the wrap width still takes a line of its own */
+        take = metrics->cols > line->glyphs ? metrics->cols - line->glyphs : 1;
+        if (take > glyphs)
+          take = glyphs;
+        line->glyphs += take;
+        line->width = (line->glyphs * metrics->char_width) - 1;
+        if (line->width > metrics->width)
+          metrics->width = line->width;
+        glyphs -= take;
+        start += take;
+      }
+  }
+
+static void text_metrics_free(struct text_metrics * metrics)
+  {
+    free(metrics->lines);
+    metrics->lines = NULL;
+  }
+
+/* Starts measuring text in a font at a font-scale, wrapping lines wider than wrap_width pixels */
+static void text_metrics_init(struct text_metrics * metrics, const struct font * font, unsigned long int scale, unsigned long int wrap_width, int utf8)
+  {
+    metrics->capacity = 0;
+    metrics->char_height = font->height * scale + 1;
+    metrics->char_start = 0;
+    metrics->char_width = font->width * scale + 1;
+    metrics->cols = (wrap_width + 1) / metrics->char_width;
+    utf8_decoder_init(&metrics->decoder);
+    metrics->height = 0;
+    metrics->line_count = 0;
+    metrics->lines = NULL;
+    metrics->offset = 0;
+    metrics->utf8 = utf8;
+    metrics->width = 0;
+    text_metrics_line(metrics, 0);
+  }
+
+/* Starts a new, empty line at byte start */
+static void text_metrics_line(struct text_metrics * metrics, unsigned long int start)
+  {
+    void * ptr;
+
+    if (metrics->line_count == metrics->capacity)
+      {
+        ptr = realloc(metrics->lines, (metrics->capacity * 2 + 1) * sizeof *metrics->lines);
+        if (ptr == NULL)
+          {
+            fprintf(stderr, "Unable to allocate text metrics\n");
+            exit(EXIT_FAILURE);
+          }
+        metrics->lines = ptr;
+        metrics->capacity = metrics->capacity * 2 + 1;
+      }
+    metrics->lines[metrics->line_count].glyphs = 0;
+    metrics->lines[metrics->line_count].start = start;
+    metrics->lines[metrics->line_count].width = 0;
+    ++metrics->line_count;
+    metrics->height = (metrics->line_count * metrics->char_height) - 1;
+  }
+
+/*
+ * Measures the next span of text without drawing it. Glyphs all have the same width, so without --utf8
+ * the text between newlines is counted rather than looked at, and only newlines are searched for
+ */
+static void text_metrics_measure(struct text_metrics * metrics, const char * text, unsigned long int len)
+  {
+    unsigned long int codepoint;
+    unsigned int consumed;
+    const char * cptr;
+    const char * end;
+    const char * newline;
+
+    end = text + len;
+    if (!metrics->utf8)
+      {
+        for (cptr = text; cptr < end; cptr = newline + 1)
+          {
+            newline = memchr(cptr, '\n', end - cptr);
+            if (newline == NULL)
+              newline = end;
+            text_metrics_add(metrics, newline - cptr, metrics->offset + (cptr - text));
+            if (newline != end)
+              text_metrics_line(metrics, metrics->offset + (newline + 1 - text));
+          }
+        metrics->offset += len;
+        return;
+      }
+    /* Each character is one glyph, decoded as in text_layout_build(), and may start in an earlier span */
+    for (cptr = text; cptr < end; cptr += consumed)
+      {
+        if (metrics->decoder.pending == 0)
+          metrics->char_start = metrics->offset + (cptr - text);
+        consumed = 1;
+        if (metrics->decoder.pending == 0 && (unsigned char) *cptr < utf8_first_multibyte)
+          codepoint = (unsigned char) *cptr;
+          else
+          {
+            consumed = utf8_decode(&metrics->decoder, (unsigned char) *cptr, &codepoint);
+            if (metrics->decoder.pending != 0)
+              continue;
+          }
+        if (codepoint == '\n')
+          text_metrics_line(metrics, metrics->offset + (cptr + 1 - text));
+          else
+          text_metrics_add(metrics, 1, metrics->char_start);
+      }
+    metrics->offset += len;
+  }
+
+static void unpack_font(const struct font * font)
   {
-    int bit_pos;
     char c;
     size_t character;
+    unsigned long int codepoint;
     size_t i;
-    int x;
-    int y;
+    unsigned long int row;
+    unsigned int x;
+    unsigned int y;
 
-    for (i = 0; i < sizeof default_font; i += bytes_per_font_character)
+    for (i = 0; i < (size_t) font->count * font->bytes_per_glyph; i += font->bytes_per_glyph)
       {
         /* Get character index */
-        character = i / bytes_per_font_character;
-        /* Convert to character */
-        c = (char) character;
-        /* Skip non-printable characters */
-        if (!isprint(c))
-          continue;
-        /* Numeric detail about character */
-        printf("%d 0x%02X %c\n", c, c, c);
+        character = i / font->bytes_per_glyph;
+        codepoint = font_codepoint(font, character);
+        if (font->codepoints != NULL && (codepoint >= utf8_first_multibyte || !isprint((int) codepoint)))
+          {
+            /* Glyphs of fonts with codepoints are all listed, by codepoint unless printable ASCII */
+            printf("U+%04lX\n", codepoint);
+          }
+          else
+          {
+            /* Convert to character */
+            c = (char) codepoint;
+            /* Skip non-printable characters */
+            if (!isprint(c))
+              continue;
+            /* Numeric detail about character */
+            printf("%d 0x%02X %c\n", c, c, c);
+          }
         /* Display pixels */
-        bit_pos = 0;
-        for (y = 0; y < font_height; ++y)
+        for (y = 0; y < font->height; ++y)
           {
-            for (x = 0; x < font_width; ++x)
-              {
-                printf("%c", (default_font[i + (bit_pos / CHAR_BIT)] & (1 << (bit_pos % CHAR_BIT))) ? '1' : '0');
-                ++bit_pos;
-              }
+            row = font_row(font, font->glyphs + i, y);
+            for (x = 0; x < font->width; ++x)
+              printf("%c", (row >> x) & 1 ? '1' : '0');
             printf("\n");
           }
       }
   }
+
+/*
+ * Feeds one byte of a multi-byte sequence to the decoder, and returns how many bytes it used: none when
+ * the byte cuts an unfinished sequence short, and one otherwise. Once nothing is pending, codepoint holds
+ * the character, or invalid_codepoint for malformed, overlong and surrogate sequences
+ */
+static unsigned int utf8_decode(struct utf8_decoder * decoder, unsigned char byte, unsigned long int * codepoint)
+  {
+    if (decoder->pending != 0)
+      {
+        if ((byte & 0xC0) != 0x80)
+          {
+            decoder->pending = 0;
+            *codepoint = invalid_codepoint;
+            return 0;
+          }
+        decoder->codepoint = (decoder->codepoint << 6) | (byte & 0x3F);
+        if (--decoder->pending != 0)
+          return 1;
+        *codepoint = decoder->codepoint;
+        if (*codepoint < decoder->min || (*codepoint >= 0xD800 && *codepoint <= 0xDFFF) || *codepoint > max_codepoint)
+          *codepoint = invalid_codepoint;
+        return 1;
+      }
+    /* The lead byte gives the length of the sequence */
+    if ((byte & 0xE0) == 0xC0)
+      {
+        decoder->codepoint = byte & 0x1F;
+        decoder->min = 0x80;
+        decoder->pending = 1;
+      }
+      else if ((byte & 0xF0) == 0xE0)
+      {
+        decoder->codepoint = byte & 0x0F;
+        decoder->min = 0x800;
+        decoder->pending = 2;
+      }
+      else if ((byte & 0xF8) == 0xF0)
+      {
+        decoder->codepoint = byte & 0x07;
+        decoder->min = 0x10000;
+        decoder->pending = 3;
+      }
+      else
+      *codepoint = invalid_codepoint;
+    return 1;
+  }
+
+static void utf8_decoder_init(struct utf8_decoder * decoder)
+  {
+    decoder->codepoint = 0;
+    decoder->min = 0;
+    decoder->pending = 0;
+  }